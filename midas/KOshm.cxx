@@ -0,0 +1,321 @@
+//
+// Name: KOshm.cxx
+// Description: shared memory byte stream for KOtcpConnection "shm:" endpoints
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h> // POLLIN, POLLOUT
+#include <time.h>
+#include <stdint.h>
+#include <atomic>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h> // shm_open(), mmap()
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#ifdef __SSE2__
+#include <emmintrin.h> // _mm_pause()
+#endif
+
+#include "KOshm.h"
+
+#define KOSHM_MAGIC 0x4b4f7368 // "KOsh"
+
+// positions count bytes since the segment was created and wrap at 2^32,
+// head - tail is the fill level as long as the ring size is below 2^31
+
+struct KOshmRing
+{
+  std::atomic<uint32_t> head; // written by the producer
+  std::atomic<uint32_t> tail; // written by the consumer
+  std::atomic<uint32_t> closed; // either side has gone
+  std::atomic<uint32_t> reader_waiting;
+  std::atomic<uint32_t> writer_waiting;
+  char pad[64 - 5*sizeof(uint32_t)]; // keep rings on separate cache lines
+};
+
+struct KOshmSegment
+{
+  std::atomic<uint32_t> magic; // set last by the creator
+  uint32_t size; // bytes per ring
+  char pad[64 - 2*sizeof(uint32_t)];
+  KOshmRing ring[2]; // [0] client to server, [1] server to client
+  // followed by the data of ring 0 and ring 1
+};
+
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "futex needs plain 32 bit words");
+
+static long futex(std::atomic<uint32_t>* addr, int op, uint32_t val, const struct timespec* timeout)
+{
+  // shared futex, the segment is mapped by two processes
+  return syscall(SYS_futex, (uint32_t*)addr, op, val, timeout, NULL, 0);
+}
+
+static double monotonicNow()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+KOshmChannel::~KOshmChannel() // dtor
+{
+  Close();
+}
+
+KOtcpError KOshmChannel::Open(const char* name, bool create)
+{
+  if (fSeg) {
+    return KOtcpError("KOshmChannel::Open()", "already open");
+  }
+
+  if (create && (fRingSize <= 0 || (fRingSize & (fRingSize - 1)) != 0)) {
+    return KOtcpError("KOshmChannel::Open()", "ring size must be a power of two");
+  }
+
+  fName = name;
+  if (fName.empty() || fName[0] != '/')
+    fName = "/" + fName;
+
+  int fd = shm_open(fName.c_str(), O_RDWR | (create ? O_CREAT|O_EXCL : 0), 0600);
+  if (fd < 0 && create && errno == EEXIST) {
+    // left behind by a creator that did not get to Close(), start a new one
+    shm_unlink(fName.c_str());
+    fd = shm_open(fName.c_str(), O_RDWR|O_CREAT|O_EXCL, 0600);
+  }
+  if (fd < 0) {
+    return KOtcpError("KOshmChannel::Open()", errno, ("shm_open(" + fName + ") error").c_str());
+  }
+
+  if (create) {
+    fSegSize = sizeof(KOshmSegment) + 2*(size_t)fRingSize;
+    if (ftruncate(fd, fSegSize) < 0) {
+      int e = errno;
+      ::close(fd);
+      shm_unlink(fName.c_str());
+      return KOtcpError("KOshmChannel::Open()", e, "ftruncate() error");
+    }
+  } else {
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(KOshmSegment)) {
+      ::close(fd);
+      return KOtcpError("KOshmChannel::Open()", ("segment " + fName + " is not ready").c_str());
+    }
+    fSegSize = st.st_size;
+  }
+
+  void* ptr = mmap(NULL, fSegSize, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  int e = errno;
+  ::close(fd);
+
+  if (ptr == MAP_FAILED) {
+    if (create)
+      shm_unlink(fName.c_str());
+    return KOtcpError("KOshmChannel::Open()", e, "mmap() error");
+  }
+
+  fSeg = (KOshmSegment*)ptr;
+  fCreator = create;
+
+  if (create) {
+    // the new segment is zero-filled, positions and flags start at 0
+    fSeg->size = fRingSize;
+    fSeg->magic.store(KOSHM_MAGIC);
+  } else if (fSeg->magic.load() != KOSHM_MAGIC || sizeof(KOshmSegment) + 2*(size_t)fSeg->size > fSegSize) {
+    // the creator is still setting it up, rings are not valid yet: nothing to signal
+    munmap(fSeg, fSegSize);
+    fSeg = NULL;
+    return KOtcpError("KOshmChannel::Open()", ("segment " + fName + " is not ready").c_str());
+  }
+
+  char* data = (char*)(fSeg + 1);
+  int tx = create ? 1 : 0;
+  fTx = &fSeg->ring[tx];
+  fRx = &fSeg->ring[1 - tx];
+  fTxData = data + tx*fSeg->size;
+  fRxData = data + (1 - tx)*fSeg->size;
+
+  if (!create) {
+    // a previous client may have closed the segment and left data behind:
+    // start with empty rings, cleared closed flags and our waiting flags
+
+    fRx->tail.store(fRx->head.load());
+    fTx->head.store(fTx->tail.load());
+    fRx->reader_waiting.store(0);
+    fTx->writer_waiting.store(0);
+    fRx->closed.store(0);
+    fTx->closed.store(0);
+  }
+
+  return KOtcpError();
+}
+
+void KOshmChannel::Close()
+{
+  if (!fSeg)
+    return;
+
+  // wake a peer sleeping in Wait(), it sees the closed flag
+
+  fTx->closed.store(1);
+  fRx->closed.store(1);
+  futex(&fTx->head, FUTEX_WAKE, INT32_MAX, NULL);
+  futex(&fRx->tail, FUTEX_WAKE, INT32_MAX, NULL);
+
+  munmap(fSeg, fSegSize);
+  if (fCreator)
+    shm_unlink(fName.c_str());
+
+  fSeg = NULL;
+  fRx = fTx = NULL;
+  fRxData = fTxData = NULL;
+}
+
+int KOshmChannel::Available() const
+{
+  if (!fSeg)
+    return 0;
+  return fRx->head.load() - fRx->tail.load(std::memory_order_relaxed);
+}
+
+int KOshmChannel::Read(const struct iovec* iov, int iovcnt)
+{
+  if (!fSeg) {
+    errno = EBADF;
+    return -1;
+  }
+
+  uint32_t size = fSeg->size;
+  uint32_t tail = fRx->tail.load(std::memory_order_relaxed);
+  uint32_t avail = fRx->head.load(std::memory_order_acquire) - tail;
+
+  if (avail == 0) {
+    if (fRx->closed.load())
+      return 0;
+    errno = EAGAIN;
+    return -1;
+  }
+
+  uint32_t done = 0;
+  for (int i = 0; i < iovcnt && done < avail; i++) {
+    uint32_t n = iov[i].iov_len;
+    if (n > avail - done)
+      n = avail - done;
+    uint32_t pos = (tail + done) & (size - 1);
+    uint32_t first = (n < size - pos) ? n : size - pos;
+    memcpy(iov[i].iov_base, fRxData + pos, first);
+    memcpy((char*)iov[i].iov_base + first, fRxData, n - first);
+    done += n;
+  }
+
+  fRx->tail.store(tail + done);
+  if (fRx->writer_waiting.load())
+    futex(&fRx->tail, FUTEX_WAKE, 1, NULL);
+
+  return done;
+}
+
+int KOshmChannel::Write(const struct iovec* iov, int iovcnt)
+{
+  if (!fSeg) {
+    errno = EBADF;
+    return -1;
+  }
+
+  if (fTx->closed.load()) {
+    errno = EPIPE;
+    return -1;
+  }
+
+  uint32_t size = fSeg->size;
+  uint32_t head = fTx->head.load(std::memory_order_relaxed);
+  uint32_t space = size - (head - fTx->tail.load(std::memory_order_acquire));
+
+  if (space == 0) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  uint32_t done = 0;
+  for (int i = 0; i < iovcnt && done < space; i++) {
+    uint32_t n = iov[i].iov_len;
+    if (n > space - done)
+      n = space - done;
+    uint32_t pos = (head + done) & (size - 1);
+    uint32_t first = (n < size - pos) ? n : size - pos;
+    memcpy(fTxData + pos, iov[i].iov_base, first);
+    memcpy(fTxData, (const char*)iov[i].iov_base + first, n - first);
+    done += n;
+  }
+
+  // sequentially consistent store and load: either the reader sees the
+  // new head before it sleeps, or we see its waiting flag and wake it
+
+  fTx->head.store(head + done);
+  if (fTx->reader_waiting.load())
+    futex(&fTx->head, FUTEX_WAKE, 1, NULL);
+
+  return done;
+}
+
+short KOshmChannel::Wait(short events, double end)
+{
+  if (!fSeg)
+    return POLLHUP;
+
+  // spinning only helps when the peer runs on another core at the same time
+
+  static const bool multicore = sysconf(_SC_NPROCESSORS_ONLN) > 1;
+  double spin_end = monotonicNow() + (multicore ? 1e-6*fSpinMicroSec : 0);
+
+  while (1) {
+    uint32_t head = fRx->head.load();
+    uint32_t tail = fTx->tail.load();
+    short revents = 0;
+    if ((events & POLLIN) && head != fRx->tail.load(std::memory_order_relaxed))
+      revents |= POLLIN;
+    if ((events & POLLOUT) && fTx->head.load(std::memory_order_relaxed) - tail < fSeg->size)
+      revents |= POLLOUT;
+    if (fRx->closed.load() || fTx->closed.load())
+      revents |= POLLHUP;
+    if (revents)
+      return revents;
+
+    double now = monotonicNow();
+    if (now >= end)
+      return 0;
+
+    if (now < spin_end) {
+#ifdef __SSE2__
+      _mm_pause();
+#endif
+      continue;
+    }
+
+    // sleep on the position the other side moves next, at most until end
+
+    double remaining = end - now;
+    struct timespec ts;
+    ts.tv_sec = (time_t)remaining;
+    ts.tv_nsec = (long)((remaining - ts.tv_sec)*1e9);
+
+    if (events & POLLIN) {
+      fRx->reader_waiting.store(1);
+      if (fRx->head.load() == head && !fRx->closed.load())
+	futex(&fRx->head, FUTEX_WAIT, head, &ts);
+      fRx->reader_waiting.store(0);
+    } else {
+      fTx->writer_waiting.store(1);
+      if (fTx->tail.load() == tail && !fTx->closed.load())
+	futex(&fTx->tail, FUTEX_WAIT, tail, &ts);
+      fTx->writer_waiting.store(0);
+    }
+  }
+}
+
+// end file
@@ -0,0 +1,59 @@
+//
+// Name: KOshm.h
+// Description: shared memory byte stream for KOtcpConnection "shm:" endpoints
+//
+// A segment holds two single-producer single-consumer rings, one per
+// direction. Read and write positions are lock-free atomics, a reader or
+// writer that has to wait sleeps on a futex in the segment and is woken
+// by the other side only when it announced that it sleeps.
+//
+
+#ifndef KOshmH
+#define KOshmH
+
+#include <string>
+
+#include "KOtcp.h"
+
+struct iovec; // <sys/uio.h>
+struct KOshmSegment;
+struct KOshmRing;
+
+class KOshmChannel
+{
+ public: // settings
+    int fRingSize = 1024*1024; // bytes per direction, power of two, used when creating
+    int fSpinMicroSec = 20; // busy-wait this long before sleeping on the futex, multi-core hosts only
+
+ public: // state
+    std::string fName;
+    bool fCreator = false; // created the segment and removes it on Close()
+    KOshmSegment* fSeg = NULL;
+    size_t fSegSize = 0;
+    KOshmRing* fRx = NULL;
+    KOshmRing* fTx = NULL;
+    char* fRxData = NULL;
+    char* fTxData = NULL;
+
+ public: // public api
+    ~KOshmChannel(); // dtor
+
+    KOtcpError Open(const char* name, bool create); // create: server side, replaces a stale segment, otherwise attach to an existing one
+    void Close();
+
+    // socket-like calls: return bytes transferred, 0 from Read() when the
+    // peer has closed, -1 with errno EAGAIN when nothing can be done now,
+    // -1 with errno EPIPE from Write() when the peer has closed
+
+    int Read(const struct iovec* iov, int iovcnt);
+    int Write(const struct iovec* iov, int iovcnt);
+    int Available() const; // bytes waiting to be read
+
+    // wait until POLLIN/POLLOUT in events is possible, the peer closed
+    // (POLLHUP) or the monotonic time end has passed (returns 0)
+
+    short Wait(short events, double end);
+};
+
+#endif
+// end file
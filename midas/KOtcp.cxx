@@ -11,9 +11,16 @@
 #include <assert.h>
 #include <string.h>
 #include <stdlib.h>
-#include <poll.h> // poll()
+#include <poll.h> // poll(), ppoll()
+#include <time.h> // clock_gettime()
+#include <math.h> // fabs(), ceil()
+#ifdef __SSE2__
+#include <emmintrin.h> // SSE2 line scanner
+#endif
 
 #include "KOtcp.h"
+#include "KOshm.h"
+#include "KOuring.h"
 
 #if defined(__CYGWIN__)
 
@@ -34,6 +41,9 @@
 #include <netdb.h>
 #include <fcntl.h>
 #include <stdarg.h>
+#include <sys/uio.h> // readv()
+#include <sys/epoll.h>
+#include <sys/un.h> // sockaddr_un
 
 // have to kludge this for Solaris 5.5.1
 #ifndef FIONREAD
@@ -89,6 +99,8 @@ KOsocketInitializer::KOsocketInitializer() // ctor
 #ifdef ONL_unix
 #include <unistd.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h> // TCP_CORK, TCP_KEEPIDLE, TCP_USER_TIMEOUT
+#include <limits.h> // IOV_MAX
 typedef int SOCKET;
 #define INVALID_SOCKET (-1)
 #define BOOL int
@@ -110,6 +122,14 @@ static std::string toString(int v)
   return buf;
 }
 
+static struct iovec makeIovec(const void* ptr, size_t len)
+{
+  struct iovec v;
+  v.iov_base = (void*)ptr;
+  v.iov_len = len;
+  return v;
+}
+
 ////////////////////////////////////////////////////////////
 //                                                        //
 //                 KOtcpError methods                     //
@@ -182,9 +202,23 @@ KOtcpError KOtcpConnection::Connect()
     return KOtcpError("Connect()", "already connected");
   }
 
+  if (fHostname.compare(0, 5, "unix:") == 0) {
+    return ConnectUnix(fHostname.substr(5));
+  }
+
+  if (fHostname.compare(0, 4, "shm:") == 0) {
+    return ConnectShm(fHostname.substr(4));
+  }
+
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_protocol = IPPROTO_TCP;
+
   struct addrinfo *res = NULL;
 
-  int ret = getaddrinfo(fHostname.c_str(), fService.c_str(), NULL, &res);
+  int ret = getaddrinfo(fHostname.c_str(), fService.c_str(), &hints, &res);
   if (ret != 0) {
     std::string s;
     s += "Invalid hostname: ";
@@ -203,10 +237,10 @@ KOtcpError KOtcpConnection::Connect()
 
   // NOTE: must free "res" using freeaddrinfo(res)
 
-  //time_t start_time = time(NULL);
+  // candidate addresses, alternating between IPv6 and IPv4 starting
+  // with the family getaddrinfo() prefers (RFC 8305 "happy eyeballs")
 
-  int last_errno = 0;
-  bool timeout = false;
+  std::vector<const struct addrinfo*> first, second, cand;
   for (const struct addrinfo *r = res; r != NULL; r = r->ai_next) {
 #if 0
     printf("addrinfo: flags %d, family %d, socktype %d, protocol %d, canonname [%s]\n",
@@ -216,84 +250,124 @@ KOtcpError KOtcpConnection::Connect()
 	   r->ai_protocol,
 	   r->ai_canonname);
 #endif
-    // skip anything but TCP addresses
-    if (r->ai_socktype != SOCK_STREAM) {
+    // skip anything but TCP over IPv4 and IPv6
+    if (r->ai_socktype != SOCK_STREAM || r->ai_protocol != IPPROTO_TCP) {
       continue;
     }
-    // skip anything but TCP protocol 6
-    if (r->ai_protocol != 6) {
+    if (r->ai_family != AF_INET && r->ai_family != AF_INET6) {
       continue;
     }
-    SOCKET sret = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
-    if (sret == INVALID_SOCKET) {
-      freeaddrinfo(res);
-      return KOtcpError("Connect()", WSAGetLastError(), "socket(AF_INET,SOCK_STREAM) error");
+    if (first.empty() || r->ai_family == first[0]->ai_family) {
+      first.push_back(r);
+    } else {
+      second.push_back(r);
     }
-    //printf("call connect %p!\n", r);
-    //printf("time %d\n", (int)(time(NULL)-start_time));
-    ret = ::connect(sret, r->ai_addr, r->ai_addrlen);
-    //printf("connect ret %d, errno %d (%s)\n", ret, errno, strerror(errno));
-    if (ret == 0) {
-      freeaddrinfo(res);
-      fConnected = true;
-      fSocket = sret;
-      return KOtcpError();
-    } else if (ret == -1 && errno == EINPROGRESS) {
-      struct pollfd pfd;
-      pfd.fd = sret;
-      pfd.events = POLLOUT;
-      pfd.revents = 0;
-      time_t poll_start_time = time(NULL);
-      int timeout_millisec = fConnectTimeoutMilliSec;
-      while (1) {
-	//printf("call poll(%d)!\n", timeout_millisec);
-	//printf("time %d\n", (int)(time(NULL)-start_time));
-	errno = 0;
-	ret = poll(&pfd, 1, timeout_millisec);
-	//printf("poll ret %d, events %d, revents %d, timeout %d ms, elapsed %d sec, errno %d (%s)\n", ret, pfd.events, pfd.revents, timeout_millisec, (int)(time(NULL)-poll_start_time), errno, strerror(errno));
-	//printf("time %d\n", (int)(time(NULL)-start_time));
-	if (ret == -1 && errno == EINTR) {
-	  time_t now = time(NULL);
-	  int elapsed_millisec = (now - poll_start_time)*1000;
-	  //printf("elapsed %d ms\n", elapsed_millisec);
-	  if (elapsed_millisec > fConnectTimeoutMilliSec) {
-	    break;
-	  }
-	  timeout_millisec = fConnectTimeoutMilliSec - elapsed_millisec;
-	  continue;
-	}
-	break;
-      };
-      if (ret == -1) {
-	fprintf(stderr, "KOtcpConnection::Connect() unexpected poll() status, poll ret %d, events %d, revents %d, errno %d (%s)\n", ret, pfd.events, pfd.revents, errno, strerror(errno));
-	last_errno = errno;
-      } else if (pfd.revents == 0) {
-	// timeout
-      } else if (pfd.revents & (POLLERR|POLLHUP)) {
-	// connection error
-	int value = 0;
-	socklen_t len = sizeof(value);
-        ret = getsockopt(sret, SOL_SOCKET, SO_ERROR, &value, &len);
-	last_errno = value;
-	//printf("getsockopt() ret %d, last_errno %d (%s), errno %d (%s)\n", ret, last_errno, strerror(last_errno), errno, strerror(errno));
-      } else if (pfd.revents & POLLOUT) {
-	freeaddrinfo(res);
-	fConnected = true;
-	fSocket = sret;
-	return KOtcpError();
+  }
+  for (size_t i = 0; i < first.size() || i < second.size(); i++) {
+    if (i < first.size())
+      cand.push_back(first[i]);
+    if (i < second.size())
+      cand.push_back(second[i]);
+  }
+
+  // race the candidates: start the next connect every fConnectStaggerMilliSec,
+  // or at once when an attempt fails, keep the first one to complete
+
+  int last_errno = 0;
+  bool timeout = false;
+  SOCKET winner = INVALID_SOCKET;
+  std::vector<struct pollfd> pfds;
+  size_t next = 0;
+  double start = Now();
+  double end = start + 0.001*fConnectTimeoutMilliSec;
+  double next_start = start;
+
+  while (winner == INVALID_SOCKET) {
+    double now = Now();
+    if (next < cand.size() && (now >= next_start || pfds.empty())) {
+      const struct addrinfo *r = cand[next++];
+      SOCKET sret = ::socket(r->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, r->ai_protocol);
+      if (sret == INVALID_SOCKET) {
+	last_errno = WSAGetLastError();
+	continue;
+      }
+      ret = ::connect(sret, r->ai_addr, r->ai_addrlen);
+      //printf("connect ret %d, errno %d (%s)\n", ret, errno, strerror(errno));
+      if (ret == 0) {
+	winner = sret;
+      } else if (ret == -1 && errno == EINPROGRESS) {
+	struct pollfd pfd;
+	pfd.fd = sret;
+	pfd.events = POLLOUT;
+	pfd.revents = 0;
+	pfds.push_back(pfd);
+	next_start = now + 0.001*fConnectStaggerMilliSec;
       } else {
-	// unknown error
-	fprintf(stderr, "KOtcpConnection::Connect() unexpected poll() status, poll ret %d, events %d, revents %d, errno %d (%s)\n", ret, pfd.events, pfd.revents, errno, strerror(errno));
+	last_errno = WSAGetLastError();
+	::close(sret);
       }
-      ret = ::close(sret);
-      //printf("close ret %d, errno %d (%s)\n", ret, errno, strerror(errno));
+      continue;
+    }
+
+    if (pfds.empty()) {
+      // every candidate failed
+      break;
+    }
+
+    if (now >= end || DeadlineExpired()) {
       timeout = true;
-    } else {
-      last_errno = WSAGetLastError();
-      ::close(sret);
+      break;
+    }
+
+    // wait for an attempt to complete, or until the next one is due
+
+    double wait_until = end;
+    if (next < cand.size() && next_start < wait_until)
+      wait_until = next_start;
+    ret = PollWait(&pfds[0], pfds.size(), (int)ceil(1000*(wait_until - now)));
+    if (ret == -1) {
+      fprintf(stderr, "KOtcpConnection::Connect() unexpected poll() status, poll ret %d, errno %d (%s)\n", ret, errno, strerror(errno));
+      last_errno = errno;
+      break;
+    }
+
+    for (size_t i = 0; i < pfds.size(); ) {
+      if (pfds[i].revents == 0) {
+	i++;
+	continue;
+      }
+      int value = 0;
+      socklen_t len = sizeof(value);
+      getsockopt(pfds[i].fd, SOL_SOCKET, SO_ERROR, &value, &len);
+      if (value == 0 && (pfds[i].revents & POLLOUT) && winner == INVALID_SOCKET) {
+	winner = pfds[i].fd;
+      } else {
+	// connection error, try the next address right away
+	last_errno = value;
+	::close(pfds[i].fd);
+	next_start = Now();
+      }
+      pfds.erase(pfds.begin() + i);
     }
   }
 
+  for (size_t i = 0; i < pfds.size(); i++) {
+    ::close(pfds[i].fd);
+  }
+
+  if (winner != INVALID_SOCKET) {
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    getsockname(winner, (struct sockaddr*)&addr, &len);
+    freeaddrinfo(res);
+    fConnected = true;
+    fSocket = winner;
+    fFamily = addr.ss_family;
+    SetKeepAlive();
+    EnableUring();
+    return KOtcpError();
+  }
+
   freeaddrinfo(res);
 
   std::string s;
@@ -305,6 +379,9 @@ KOtcpError KOtcpConnection::Connect()
 
   if (last_errno != 0) {
     return KOtcpError("Connect()", last_errno, s.c_str());
+  } else if (cand.empty()) {
+    s += ": no IPv4 or IPv6 address";
+    return KOtcpError("Connect()", s.c_str());
   } else if (timeout) {
     s += ": timeout";
     return KOtcpError("Connect()", s.c_str());
@@ -314,16 +391,127 @@ KOtcpError KOtcpConnection::Connect()
   }
 }
 
+KOtcpError KOtcpConnection::ConnectUnix(const std::string& path)
+{
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path)) {
+    return KOtcpError("ConnectUnix()", ("socket path too long: " + path).c_str());
+  }
+  strcpy(addr.sun_path, path.c_str());
+
+  SOCKET sret = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (sret == INVALID_SOCKET) {
+    return KOtcpError("ConnectUnix()", WSAGetLastError(), "socket(AF_UNIX,SOCK_STREAM) error");
+  }
+
+  // local connects complete or fail at once, EAGAIN means a full listen backlog
+
+  int ret = ::connect(sret, (struct sockaddr*)&addr, sizeof(addr));
+  if (ret < 0) {
+    int e = WSAGetLastError();
+    ::close(sret);
+    return KOtcpError("ConnectUnix()", e, ("connect(" + path + ")").c_str());
+  }
+
+  fConnected = true;
+  fSocket = sret;
+  fFamily = AF_UNIX;
+  EnableUring();
+  return KOtcpError();
+}
+
+KOtcpError KOtcpConnection::ConnectShm(const std::string& name)
+{
+  KOshmChannel* shm = new KOshmChannel;
+  KOtcpError e = shm->Open(name.c_str(), fShmCreate);
+  if (e.error) {
+    delete shm;
+    return e;
+  }
+
+  fConnected = true;
+  fShm = shm;
+  fFamily = 0;
+  return KOtcpError();
+}
+
+void KOtcpConnection::EnableUring()
+{
+  if (!fUseUring || !KOuring::Supported())
+    return;
+
+  KOuring* uring = new KOuring;
+  uring->fSendHighWater = fSendHighWater;
+  KOtcpError e = uring->Init(fSocket);
+  if (e.error) {
+    fprintf(stderr, "KOtcpConnection::EnableUring() using poll(): %s\n", e.message.c_str());
+    delete uring;
+    return;
+  }
+
+  fUring = uring;
+}
+
+int KOtcpConnection::RecvVector(const struct iovec* iov, int iovcnt)
+{
+  if (fShm) {
+    return fShm->Read(iov, iovcnt);
+  }
+  if (fUring) {
+    return fUring->Read(iov, iovcnt);
+  }
+  return ::readv(fSocket, iov, iovcnt);
+}
+
+int KOtcpConnection::SendVector(const struct iovec* iov, int iovcnt, bool more)
+{
+  if (fShm) {
+    return fShm->Write(iov, iovcnt);
+  }
+  if (fUring) {
+    int ret = fUring->Write(iov, iovcnt);
+    if (!more)
+      fUring->Submit();
+    return ret;
+  }
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = (struct iovec*)iov;
+  msg.msg_iovlen = iovcnt;
+  return ::sendmsg(fSocket, &msg, MSG_NOSIGNAL);
+}
+
 KOtcpError KOtcpConnection::Close()
 {
   if (!fConnected) {
     return KOtcpError("Close()", "not connected");
   }
 
-  int ret = ::close(fSocket);
+  if (fSendBuf.size() > fSendPtr) {
+    KOtcpError e = Flush(true);
+    if (e.error) {
+      fprintf(stderr, "KOtcpConnection::Close() dropping %d unsent bytes: %s\n", SendQueued(), e.message.c_str());
+    }
+  }
+  fSendBuf.clear();
+  fSendPtr = 0;
+
+  if (fUring) {
+    delete fUring; // before the socket, the ring may still be sending from it
+    fUring = NULL;
+  }
 
-  if (ret < 0) {
-    return KOtcpError("Close()", WSAGetLastError(), "close() error");
+  if (fShm) {
+    delete fShm;
+    fShm = NULL;
+  } else {
+    int ret = ::close(fSocket);
+
+    if (ret < 0) {
+      return KOtcpError("Close()", WSAGetLastError(), "close() error");
+    }
   }
 
   fConnected = false;
@@ -333,11 +521,192 @@ KOtcpError KOtcpConnection::Close()
   return KOtcpError();
 }
 
+double KOtcpConnection::Now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+bool KOtcpConnection::DeadlineExpired() const
+{
+  return fDeadline > 0 && Now() >= fDeadline;
+}
+
+// Read timeout from round trip times as for the TCP retransmission timeout (RFC 6298):
+// SRTT + 4*RTTVAR, kept between fMinReadTimeoutMilliSec and fMaxReadTimeoutMilliSec.
+
+static int clampTimeout(int t, int min_millisec, int max_millisec)
+{
+  if (t < min_millisec)
+    return min_millisec;
+  if (t > max_millisec)
+    return max_millisec;
+  return t;
+}
+
+void KOtcpConnection::AddRttSample(double rtt)
+{
+  if (fSrtt == 0) {
+    fSrtt = rtt;
+    fRttVar = rtt/2;
+  } else {
+    fRttVar = 0.75*fRttVar + 0.25*fabs(fSrtt - rtt);
+    fSrtt = 0.875*fSrtt + 0.125*rtt;
+  }
+  if (fMaxReadTimeoutMilliSec > 0) {
+    fReadTimeoutMilliSec = clampTimeout((int)ceil(1000*(fSrtt + 4*fRttVar)), fMinReadTimeoutMilliSec, fMaxReadTimeoutMilliSec);
+  }
+}
+
+void KOtcpConnection::RttBackoff()
+{
+  if (fMaxReadTimeoutMilliSec > 0) {
+    fReadTimeoutMilliSec = clampTimeout(2*fReadTimeoutMilliSec, fMinReadTimeoutMilliSec, fMaxReadTimeoutMilliSec);
+  }
+}
+
+// poll() sockets for wait_millisec or until fDeadline, whichever comes first.
+// Signals restart the wait with the remaining time, measured on the monotonic clock.
+
+int KOtcpConnection::PollWait(struct pollfd* pfd, int nfds, int wait_millisec)
+{
+  double end = Now() + 0.001*wait_millisec;
+  if (fDeadline > 0 && fDeadline < end)
+    end = fDeadline;
+  while (1) {
+    double remaining = end - Now();
+    if (remaining < 0)
+      remaining = 0;
+    struct timespec ts;
+    ts.tv_sec = (time_t)remaining;
+    ts.tv_nsec = (long)((remaining - ts.tv_sec)*1e9);
+    for (int i = 0; i < nfds; i++)
+      pfd[i].revents = 0;
+    int ret = ppoll(pfd, nfds, &ts, NULL);
+    if (ret == -1 && errno == EINTR) {
+      if (Now() < end)
+	continue;
+      for (int i = 0; i < nfds; i++)
+	pfd[i].revents = 0;
+      return 0;
+    }
+    return ret;
+  }
+}
+
 KOtcpError KOtcpConnection::BytesAvailable(int *nbytes)
 {
   return WaitBytesAvailable(0, nbytes);
 }
 
+KOtcpError KOtcpConnection::WaitReadable(int wait_millisec, bool *readable)
+{
+  *readable = false;
+
+  // a request still sitting in the send queue would never be answered,
+  // io_uring submits it together with the wait for the reply
+
+  if (fSendBuf.size() > fSendPtr) {
+    KOtcpError e = Flush(true, true);
+    if (e.error) {
+      return e;
+    }
+  }
+
+  return PollSocket(POLLIN, wait_millisec, readable);
+}
+
+KOtcpError KOtcpConnection::PollSocket(short events, int wait_millisec, bool *ready)
+{
+  *ready = false;
+
+  if (fShm) {
+    double end = Now() + 0.001*wait_millisec;
+    if (fDeadline > 0 && fDeadline < end)
+      end = fDeadline;
+    // a closed peer is reported by the following read or write
+    *ready = (fShm->Wait(events, end) != 0);
+    return KOtcpError();
+  }
+
+  if (fUring) {
+    double end = Now() + 0.001*wait_millisec;
+    if (fDeadline > 0 && fDeadline < end)
+      end = fDeadline;
+    *ready = (fUring->Wait(events, end) != 0);
+    return KOtcpError();
+  }
+
+  struct pollfd pfd;
+  pfd.fd = fSocket;
+  pfd.events = events;
+  pfd.revents = 0;
+  int ret = PollWait(&pfd, 1, wait_millisec);
+  if (ret == -1) {
+    return KOtcpError("PollSocket()", errno, "poll() error");
+  } else if (pfd.revents == 0) {
+    // timeout
+  } else if (pfd.revents & (POLLERR|POLLHUP)) {
+    // connection error, let recv() or send() report it
+    *ready = true;
+  } else if (pfd.revents & events) {
+    // have data to read or space to write
+    *ready = true;
+  } else {
+    // unknown error
+    fprintf(stderr, "KOtcpConnection::PollSocket() unexpected poll() status, poll ret %d, events %d, revents %d, errno %d (%s)\n", ret, pfd.events, pfd.revents, errno, strerror(errno));
+    return KOtcpError("PollSocket()", errno, "poll() unexpected state");
+  }
+#if 0
+  time_t start = time(NULL);
+  while (wait_millisec > 0) {
+    timeval tv;
+    tv.tv_sec = wait_millisec/1000;
+    tv.tv_usec = (wait_millisec%1000)*1000;
+    fd_set fdset;
+    FD_ZERO(&fdset);
+    FD_SET(fSocket, &fdset);
+    int n = ::select(fSocket+1, &fdset, 0, 0, &tv);
+
+#if 0
+    printf("timeout is %d, socket is %d, n is %d, fdset is %d, tv is %d %d\n",
+	   fTimeout,fSocket,n,FD_ISSET(fSocket,&fdset),tv.tv_sec,tv.tv_usec);
+#endif
+
+    if (n < 0) {
+      int xerrno = WSAGetLastError();
+      if (xerrno == EAGAIN) {
+	// ...
+      } else if (xerrno == EINTR) {
+	// alarm signal from midas watchdog
+      } else {
+	return KOtcpError("WaitBytesAvailable()", xerrno, "select() error");
+      }
+
+      time_t now = time(NULL);
+      int elapsed = now - start;
+      if (elapsed*1000 <= wait_millisec) {
+	wait_millisec -= elapsed*1000;
+	continue;
+      }
+    }
+
+    if ((n == 0)||(!FD_ISSET(fSocket,&fdset))) {
+      *nbytes = 0;
+      return KOtcpError();
+    }
+
+    //printf("n %d, isset %d\n", n, FD_ISSET(fSocket,&fdset));
+
+    // we have data in the socket
+    break;
+  }
+#endif
+
+  return KOtcpError();
+}
+
 KOtcpError KOtcpConnection::WaitBytesAvailable(int wait_millisec, int *nbytes)
 {
   if (!fConnected) {
@@ -347,131 +716,280 @@ KOtcpError KOtcpConnection::WaitBytesAvailable(int wait_millisec, int *nbytes)
   *nbytes = 0;
 
   if (wait_millisec > 0) {
-    struct pollfd pfd;
-    pfd.fd = fSocket;
-    pfd.events = POLLIN;
-    pfd.revents = 0;
-    time_t poll_start_time = time(NULL);
-    int timeout_millisec = wait_millisec;
-    int ret = 0;
-    while (1) {
-      //printf("call poll(%d)!\n", timeout_millisec);
-      //printf("time %d\n", (int)(time(NULL)-poll_start_time));
-      //errno = 0;
-      ret = poll(&pfd, 1, timeout_millisec);
-      //printf("poll ret %d, events %d, revents %d, errno %d (%s)\n", ret, pfd.events, pfd.revents, errno, strerror(errno));
-      //printf("time %d\n", (int)(time(NULL)-poll_start_time));
-      if (ret == -1 && errno == EINTR) {
-	time_t now = time(NULL);
-	int elapsed_millisec = (now - poll_start_time)*1000;
-	//printf("elapsed %d ms\n", elapsed_millisec);
-	if (elapsed_millisec > wait_millisec) {
-	  break;
-	}
-	timeout_millisec = wait_millisec - elapsed_millisec;
-	continue;
-      }
-      break;
-    };
-    if (ret == -1) {
-      return KOtcpError("WaitBytesAvailable()", errno, "poll() error");
-    } else if (pfd.revents == 0) {
-      // timeout
-    } else if (pfd.revents & (POLLERR|POLLHUP)) {
-      // connection error
-    } else if (pfd.revents & POLLIN) {
-      // have data to read
-    } else {
-      // unknown error
-      fprintf(stderr, "KOtcpConnection::Connect() unexpected poll() status, poll ret %d, events %d, revents %d, errno %d (%s)\n", ret, pfd.events, pfd.revents, errno, strerror(errno));
-      return KOtcpError("WaitBytesAvailable()", errno, "poll() unexpected state");
+    bool readable = false;
+    KOtcpError e = WaitReadable(wait_millisec, &readable);
+    if (e.error) {
+      return e;
     }
-#if 0
-    time_t start = time(NULL);
-    while (wait_millisec > 0) {
-      timeval tv;
-      tv.tv_sec = wait_millisec/1000;
-      tv.tv_usec = (wait_millisec%1000)*1000;
-      fd_set fdset;
-      FD_ZERO(&fdset);
-      FD_SET(fSocket, &fdset);
-      int n = ::select(fSocket+1, &fdset, 0, 0, &tv);
+  }
 
-#if 0
-      printf("timeout is %d, socket is %d, n is %d, fdset is %d, tv is %d %d\n",
-	     fTimeout,fSocket,n,FD_ISSET(fSocket,&fdset),tv.tv_sec,tv.tv_usec);
+  if (fShm) {
+    *nbytes = fShm->Available();
+    return KOtcpError();
+  }
+
+  if (fUring) {
+    *nbytes = fUring->Available();
+    return KOtcpError();
+  }
+
+#if defined(ONL_winnt)
+  unsigned long value = 0;
+  int ret = ::ioctlsocket(fSocket,FIONREAD,&value);
+#elif defined(ONL_unix)
+  int value = 0;
+  int ret = ::ioctl(fSocket,FIONREAD,&value);
 #endif
 
-      if (n < 0) {
-	int xerrno = WSAGetLastError();
-	if (xerrno == EAGAIN) {
-	  // ...
-	} else if (xerrno == EINTR) {
-	  // alarm signal from midas watchdog
-	} else {
-	  return KOtcpError("WaitBytesAvailable()", xerrno, "select() error");
-	}
-
-	time_t now = time(NULL);
-	int elapsed = now - start;
-	if (elapsed*1000 <= wait_millisec) {
-	  wait_millisec -= elapsed*1000;
+  if (ret < 0) {
+    return KOtcpError("WaitBytesAvailable()", WSAGetLastError(), "ioctl(FIONREAD) error");
+  }
+
+  *nbytes = value;
+  return KOtcpError();
+}
+
+KOtcpError KOtcpConnection::WriteBytes(const char* data, int byteCount)
+{
+  if (!fConnected) {
+    return KOtcpError("WriteBytes()", "Not connected");
+  }
+
+  // nothing queued: send directly, queue whatever the kernel does not take
+
+  if (fSendBuf.size() == fSendPtr) {
+    fSendBuf.clear();
+    fSendPtr = 0;
+
+    while (byteCount > 0) {
+      struct iovec iov = makeIovec(data, byteCount);
+      int ret = SendVector(&iov, 1);
+
+      if (ret < 0) {
+	if (errno == EINTR)
 	  continue;
-	}
+	if (errno == EAGAIN || errno == EWOULDBLOCK)
+	  break;
+	return KOtcpError("WriteBytes()", WSAGetLastError(), "send() error");
       }
 
-      if ((n == 0)||(!FD_ISSET(fSocket,&fdset))) {
-	*nbytes = 0;
-	return KOtcpError();
+      data += ret;
+      byteCount -= ret;
+    }
+
+    if (byteCount == 0)
+      return KOtcpError();
+  }
+
+  KOtcpError e = QueueBytes(data, byteCount);
+  if (e.error) {
+    return e;
+  }
+
+  return Flush(false);
+}
+
+KOtcpError KOtcpConnection::WriteVector(const struct iovec* iov, int iovcnt)
+{
+  if (!fConnected) {
+    return KOtcpError("WriteVector()", "Not connected");
+  }
+
+  // data already queued or too many pieces for one sendmsg(): go through the queue
+
+  if (fSendBuf.size() > fSendPtr || iovcnt > IOV_MAX) {
+    for (int i=0; i<iovcnt; i++) {
+      KOtcpError e = QueueBytes((const char*)iov[i].iov_base, iov[i].iov_len);
+      if (e.error) {
+	return e;
       }
+    }
+    return Flush(false);
+  }
 
-      //printf("n %d, isset %d\n", n, FD_ISSET(fSocket,&fdset));
+  std::vector<struct iovec> v(iov, iov + iovcnt);
+  size_t first = 0;
 
-      // we have data in the socket
-      break;
+  while (first < v.size()) {
+    int ret = SendVector(&v[first], v.size() - first);
+
+    if (ret < 0) {
+      if (errno == EINTR)
+	continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+	break;
+      return KOtcpError("WriteVector()", WSAGetLastError(), "sendmsg() error");
     }
-#endif
+
+    // skip what was sent, possibly ending inside one piece
+
+    size_t sent = ret;
+    while (first < v.size() && sent >= v[first].iov_len) {
+      sent -= v[first].iov_len;
+      first++;
+    }
+    if (sent > 0) {
+      v[first].iov_base = (char*)v[first].iov_base + sent;
+      v[first].iov_len -= sent;
+    }
+  }
+
+  for (; first < v.size(); first++) {
+    KOtcpError e = QueueBytes((const char*)v[first].iov_base, v[first].iov_len);
+    if (e.error) {
+      return e;
+    }
+  }
+
+  return KOtcpError();
+}
+
+KOtcpError KOtcpConnection::SetCork(bool cork)
+{
+  if (!fConnected) {
+    return KOtcpError("SetCork()", "Not connected");
   }
 
-#if defined(ONL_winnt)
-  unsigned long value = 0;
-  int ret = ::ioctlsocket(fSocket,FIONREAD,&value);
-#elif defined(ONL_unix)
-  int value = 0;
-  int ret = ::ioctl(fSocket,FIONREAD,&value);
-#endif
+  if (fFamily != AF_INET && fFamily != AF_INET6) {
+    return KOtcpError(); // local transports do not batch small writes
+  }
+
+  int value = cork ? 1 : 0;
+  int ret = ::setsockopt(fSocket, IPPROTO_TCP, TCP_CORK, &value, sizeof(value));
+  if (ret < 0) {
+    return KOtcpError("SetCork()", WSAGetLastError(), "setsockopt(TCP_CORK) error");
+  }
+
+  return KOtcpError();
+}
+
+// dead peer detection by the kernel: keepalive probes on an idle connection,
+// TCP_USER_TIMEOUT for data that is never acknowledged
+
+KOtcpError KOtcpConnection::SetKeepAlive()
+{
+  if (!fConnected) {
+    return KOtcpError("SetKeepAlive()", "Not connected");
+  }
+
+  if (fFamily != AF_INET && fFamily != AF_INET6) {
+    return KOtcpError();
+  }
+
+  KOtcpError e;
+  int value = (fKeepAliveSec > 0) ? 1 : 0;
+  if (::setsockopt(fSocket, SOL_SOCKET, SO_KEEPALIVE, &value, sizeof(value)) < 0) {
+    e = KOtcpError("SetKeepAlive()", WSAGetLastError(), "setsockopt(SO_KEEPALIVE) error");
+  }
+  if (fKeepAliveSec > 0) {
+    if (::setsockopt(fSocket, IPPROTO_TCP, TCP_KEEPIDLE, &fKeepAliveSec, sizeof(fKeepAliveSec)) < 0) {
+      e = KOtcpError("SetKeepAlive()", WSAGetLastError(), "setsockopt(TCP_KEEPIDLE) error");
+    }
+    if (::setsockopt(fSocket, IPPROTO_TCP, TCP_KEEPINTVL, &fKeepAliveIntervalSec, sizeof(fKeepAliveIntervalSec)) < 0) {
+      e = KOtcpError("SetKeepAlive()", WSAGetLastError(), "setsockopt(TCP_KEEPINTVL) error");
+    }
+    if (::setsockopt(fSocket, IPPROTO_TCP, TCP_KEEPCNT, &fKeepAliveCount, sizeof(fKeepAliveCount)) < 0) {
+      e = KOtcpError("SetKeepAlive()", WSAGetLastError(), "setsockopt(TCP_KEEPCNT) error");
+    }
+  }
+  if (fUserTimeoutMilliSec > 0) {
+    unsigned int timeout = fUserTimeoutMilliSec;
+    if (::setsockopt(fSocket, IPPROTO_TCP, TCP_USER_TIMEOUT, &timeout, sizeof(timeout)) < 0) {
+      e = KOtcpError("SetKeepAlive()", WSAGetLastError(), "setsockopt(TCP_USER_TIMEOUT) error");
+    }
+  }
+  if (e.error) {
+    fprintf(stderr, "KOtcpConnection::SetKeepAlive() %s\n", e.message.c_str());
+  }
+
+  return e;
+}
+
+KOtcpError KOtcpConnection::QueueBytes(const char* data, int byteCount)
+{
+  if (!fConnected) {
+    return KOtcpError("QueueBytes()", "Not connected");
+  }
+
+  fSendBuf.append(data, byteCount);
+
+  // backpressure: block until the queue drains below the high-water mark
+
+  while (SendQueued() > fSendHighWater) {
+    KOtcpError e = Flush(false);
+    if (e.error) {
+      return e;
+    }
+
+    if (SendQueued() <= fSendHighWater)
+      break;
+
+    bool writable = false;
+    e = PollSocket(POLLOUT, fWriteTimeoutMilliSec, &writable);
+    if (e.error) {
+      return e;
+    }
 
-  if (ret < 0) {
-    return KOtcpError("WaitBytesAvailable()", WSAGetLastError(), "ioctl(FIONREAD) error");
+    if (!writable) {
+      return KOtcpError("QueueBytes()", "Timeout, send queue above high-water mark");
+    }
   }
 
-  *nbytes = value;
   return KOtcpError();
 }
 
-KOtcpError KOtcpConnection::WriteBytes(const char* data, int byteCount)
+KOtcpError KOtcpConnection::Flush(bool wait, bool more)
 {
   if (!fConnected) {
-    return KOtcpError("WriteBytes()", "Not connected");
+    return KOtcpError("Flush()", "Not connected");
   }
 
-  int dptr = 0;
-  int toSend = byteCount;
+  while (fSendPtr < fSendBuf.size()) {
+    struct iovec iov = makeIovec(fSendBuf.data() + fSendPtr, fSendBuf.size() - fSendPtr);
+    int ret = SendVector(&iov, 1, more);
+
+    if (ret < 0) {
+      if (errno == EINTR)
+	continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+	return KOtcpError("Flush()", WSAGetLastError(), "send() error");
+      if (!wait)
+	break;
+
+      bool writable = false;
+      KOtcpError e = PollSocket(POLLOUT, fWriteTimeoutMilliSec, &writable);
+      if (e.error) {
+	return e;
+      }
 
-  while (toSend != 0) {
-    int ret = ::send(fSocket, &data[dptr], toSend, 0);
+      if (!writable) {
+	return KOtcpError("Flush()", "Timeout");
+      }
 
-    if (ret <= 0) {
-      return KOtcpError("WriteBytes()", WSAGetLastError(), "send() error");
+      continue;
     }
 
-    dptr += ret;
-    toSend -= ret;
+    fSendPtr += ret;
+  }
+
+  // drop sent data, keep the unsent rest at the start of the queue
+
+  if (fSendPtr == fSendBuf.size()) {
+    fSendBuf.clear();
+    fSendPtr = 0;
+  } else if (fSendPtr > fSendBuf.size()/2) {
+    fSendBuf.erase(0, fSendPtr);
+    fSendPtr = 0;
   }
 
   return KOtcpError();
 }
 
+int KOtcpConnection::SendQueued() const
+{
+  return fSendBuf.size() - fSendPtr;
+}
+
 KOtcpError KOtcpConnection::WriteString(const std::string& s)
 {
   if (!fConnected) {
@@ -481,6 +999,15 @@ KOtcpError KOtcpConnection::WriteString(const std::string& s)
   return WriteBytes(s.c_str(), s.length());
 }
 
+KOtcpError KOtcpConnection::QueueString(const std::string& s)
+{
+  if (!fConnected) {
+    return KOtcpError("QueueString()", "Not connected");
+  }
+
+  return QueueBytes(s.c_str(), s.length());
+}
+
 KOtcpError KOtcpConnection::ReadBytes(char* buffer, int byteCount)
 {
   if (!fConnected) {
@@ -507,24 +1034,35 @@ KOtcpError KOtcpConnection::ReadBytes(char* buffer, int byteCount)
   int toRecv = byteCount;
 
   while (toRecv > 0) {
-    int nbytes = 0;
-    KOtcpError e = WaitBytesAvailable(fReadTimeoutMilliSec, &nbytes);
+    bool readable = false;
+    KOtcpError e = WaitReadable(fReadTimeoutMilliSec, &readable);
 
     if (e.error) {
       return e;
     }
 
-    if (nbytes == 0) {
+    if (!readable) {
       return KOtcpError("ReadBytes()", "Timeout");
     }
 
-    if (nbytes > toRecv)
-      nbytes = toRecv;
+    // the receive buffer is empty at this point, whatever
+    // follows the requested data is read ahead into it
+    // by the same readv() call
 
-    int ret = ::recv(fSocket, &buffer[dptr], nbytes, 0);
+    PrepareBuf();
+
+    struct iovec iov[2];
+    iov[0].iov_base = &buffer[dptr];
+    iov[0].iov_len  = toRecv;
+    iov[1].iov_base = fBuf + fBufUsed;
+    iov[1].iov_len  = fBufSize - fBufUsed;
+
+    int ret = RecvVector(iov, 2);
 
     if (ret < 0) {
-      return KOtcpError("ReadBytes()", WSAGetLastError(), "recv() error");
+      if (errno == EINTR || errno == EAGAIN)
+	continue;
+      return KOtcpError("ReadBytes()", WSAGetLastError(), "readv() error");
     }
 
     if (ret == 0) {
@@ -539,6 +1077,11 @@ KOtcpError KOtcpConnection::ReadBytes(char* buffer, int byteCount)
       return KOtcpError("ReadBytes()", "Connection was closed unexpectedly");
     }
 
+    if (ret > toRecv) {
+      fBufUsed += ret - toRecv;
+      ret = toRecv;
+    }
+
     dptr += ret;
     toRecv -= ret;
   }
@@ -546,7 +1089,11 @@ KOtcpError KOtcpConnection::ReadBytes(char* buffer, int byteCount)
   return KOtcpError();
 }
 
-KOtcpError KOtcpConnection::ReadBuf()
+// allocate the receive buffer, make room for new data at its end.
+// unread data is only moved to the start of the buffer when less
+// than a quarter of the buffer is left free behind it.
+
+void KOtcpConnection::PrepareBuf()
 {
   if (fBufSize == 0) {
     fBufSize = 512*1024;
@@ -559,31 +1106,89 @@ KOtcpError KOtcpConnection::ReadBuf()
   if (fBufPtr == fBufUsed) {
     fBufUsed = 0;
     fBufPtr = 0;
+  } else if (fBufPtr > 0 && fBufSize - fBufUsed < fBufSize/4) {
+    memmove(fBuf, fBuf + fBufPtr, fBufUsed - fBufPtr);
+    fBufUsed -= fBufPtr;
+    fBufPtr = 0;
   }
+}
 
-  assert(fBufUsed == 0);
+// read whatever the socket has into the free end of the receive buffer,
+// keeping unread data: one poll() and one recv() per call
 
-  int nbytes = 0;
-  KOtcpError e = WaitBytesAvailable(fReadTimeoutMilliSec, &nbytes);
-  if (e.error) {
-    return e;
-  }
+KOtcpError KOtcpConnection::ReadBuf()
+{
+  PrepareBuf();
 
-  if (nbytes == 0) {
-    return KOtcpError("ReadBuf","Timeout");
+  if (fBufUsed == fBufSize) {
+    return KOtcpError("ReadBuf", "Receive buffer full");
   }
 
-  if (nbytes > fBufSize) {
-    nbytes = fBufSize;
+  while (1) {
+    bool readable = false;
+    KOtcpError e = WaitReadable(fReadTimeoutMilliSec, &readable);
+    if (e.error) {
+      return e;
+    }
+
+    if (!readable) {
+      if (!DeadlineExpired()) {
+        RttBackoff();
+      }
+      return KOtcpError("ReadBuf","Timeout");
+    }
+
+    struct iovec iov = makeIovec(fBuf + fBufUsed, fBufSize - fBufUsed);
+    int ret = RecvVector(&iov, 1);
+
+    if (ret < 0) {
+      if (errno == EINTR || errno == EAGAIN)
+	continue;
+      return KOtcpError("ReadBuf", WSAGetLastError(), "recv() error");
+    }
+
+    if (ret == 0) {
+      return KOtcpError("ReadBuf", "Connection was closed");
+    }
+
+    fBufUsed += ret;
+    return KOtcpError();
   }
+}
 
-  e = ReadBytes(fBuf, nbytes);
-  if (e.error) {
-    return e;
+KOtcpError KOtcpConnection::ReadAvailable(int *nbytes, bool *closed)
+{
+  *nbytes = 0;
+  *closed = false;
+
+  if (!fConnected) {
+    return KOtcpError("ReadAvailable()", "Not connected");
   }
 
-  fBufPtr = 0;
-  fBufUsed = nbytes;
+  PrepareBuf();
+
+  // edge-triggered: read until the socket is drained
+
+  while (fBufUsed < fBufSize) {
+    struct iovec iov = makeIovec(fBuf + fBufUsed, fBufSize - fBufUsed);
+    int ret = RecvVector(&iov, 1);
+
+    if (ret < 0) {
+      if (errno == EINTR)
+	continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+	break;
+      return KOtcpError("ReadAvailable()", WSAGetLastError(), "recv() error");
+    }
+
+    if (ret == 0) {
+      *closed = true;
+      break;
+    }
+
+    fBufUsed += ret;
+    *nbytes += ret;
+  }
 
   return KOtcpError();
 }
@@ -599,29 +1204,112 @@ static bool eolchar(char c)
   }
 }
 
+// find first CR or LF in [p, end), NULL if there is none
+
+static const char* findEol(const char* p, const char* end)
+{
+#ifdef __SSE2__
+  const __m128i cr = _mm_set1_epi8('\r');
+  const __m128i lf = _mm_set1_epi8('\n');
+  while (end - p >= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*)p);
+    int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, lf)));
+    if (mask)
+      return p + __builtin_ctz(mask);
+    p += 16;
+  }
+#endif
+  while (p < end) {
+    if (eolchar(*p))
+      return p;
+    p++;
+  }
+  return NULL;
+}
+
 bool KOtcpConnection::CopyBuf(std::string *s)
 {
   assert(fBuf);
   assert(fBufUsed > 0);
 
-  while (fBufPtr < fBufUsed) {
-    char c = fBuf[fBufPtr];
+  const char* start = fBuf + fBufPtr;
+  const char* end = fBuf + fBufUsed;
+  const char* eol = findEol(start, end);
 
-    if (eolchar(c)) {
-      while (fBufPtr < fBufUsed) {
-	if (!eolchar(fBuf[fBufPtr])) {
-	  break;
-	}
-	fBufPtr++;
-      }
-      return true;
+  if (!eol) {
+    s->append(start, end - start);
+    fBufPtr = fBufUsed;
+    return false;
+  }
+
+  s->append(start, eol - start);
+  fBufPtr = eol - fBuf;
+
+  while (fBufPtr < fBufUsed) {
+    if (!eolchar(fBuf[fBufPtr])) {
+      break;
     }
+    fBufPtr++;
+  }
+
+  return true;
+}
+
+bool KOtcpConnection::GetBufferedString(std::string *s)
+{
+  std::string_view v;
+  if (!GetBufferedStringView(&v))
+    return false;
+  s->assign(v.data(), v.size());
+  return true;
+}
+
+bool KOtcpConnection::GetBufferedStringView(std::string_view *s)
+{
+  if (!fBuf || fBufPtr >= fBufUsed)
+    return false;
 
-    (*s) += c;
-    fBufPtr ++;
+  const char* eol = findEol(fBuf + fBufPtr, fBuf + fBufUsed);
+
+  if (!eol)
+    return false; // incomplete line, wait for more data
+
+  *s = std::string_view(fBuf + fBufPtr, eol - (fBuf + fBufPtr));
+
+  fBufPtr = eol - fBuf;
+  while (fBufPtr < fBufUsed && eolchar(fBuf[fBufPtr]))
+    fBufPtr++;
+
+  return true;
+}
+
+KOtcpError KOtcpConnection::ReadStringView(std::string_view *s, unsigned max_length)
+{
+  if (!fConnected) {
+    return KOtcpError("ReadStringView()", "Not connected");
   }
 
-  return false;
+  while (1) {
+    if (GetBufferedStringView(s)) {
+      return KOtcpError();
+    }
+
+    if (max_length && fBufUsed - fBufPtr > (int)max_length) {
+      return KOtcpError("ReadStringView()", "Max string length exceeded");
+    }
+
+    if (fBufUsed == fBufSize && fBufPtr == 0) {
+      return KOtcpError("ReadStringView()", "Line longer than receive buffer");
+    }
+
+    // keep the partial line, wait for the rest
+
+    KOtcpError e = ReadBuf();
+    if (e.error) {
+      return e;
+    }
+  }
+  // NOT REACHED
 }
 
 KOtcpError KOtcpConnection::ReadString(std::string *s, unsigned max_length)
@@ -789,35 +1477,17 @@ KOtcpError KOtcpConnection::HttpReadResponse(std::vector<std::string> *reply_hea
     // no Content-Length header, read data until socket is closed
     //
     while (1) {
-      int nbytes = 0;
-
-      KOtcpError e = WaitBytesAvailable(fReadTimeoutMilliSec, &nbytes);
-
-      //printf("nbytes %d, error %d, errno %d\n", nbytes, e.error, e.xerrno);
-
-      if (e.error)
-	return e;
-
-      if (nbytes == 0) {
-	break;
+      if (fBuf && fBufPtr < fBufUsed) {
+	reply_body->append(fBuf + fBufPtr, fBufUsed - fBufPtr);
+	fBufPtr = fBufUsed;
       }
 
-      char* buf = (char*)malloc(nbytes+1);
-      assert(buf);
+      KOtcpError e = ReadBuf();
 
-      e = ReadBytes(buf, nbytes);
+      //printf("error %d, errno %d\n", e.error, e.xerrno);
 
       if (e.error)
-	return e;
-
-      // make sure string is zero-terminated
-      buf[nbytes] = 0;
-
-      //printf("nbytes %d, len %d, data [%s]\n", nbytes, strlen(buf), buf);
-
-      (*reply_body) += buf;
-
-      free(buf);
+	break; // timeout or connection closed
     }
   }
 
@@ -850,23 +1520,22 @@ KOtcpError KOtcpConnection::HttpGet(const std::vector<std::string>& headers, con
       return e;
   }
 
-  std::string get;
-  get += "GET ";
-  get += url;
-  get += " HTTP/1.1";
-  get += CRLF;
+  // the whole request goes out with a single sendmsg()
 
-  e = WriteString(get);
-  if (e.error)
-    return e;
+  const char* get = "GET ";
+  const char* http = " HTTP/1.1\r\n";
 
+  std::vector<struct iovec> iov;
+  iov.push_back(makeIovec(get, strlen(get)));
+  iov.push_back(makeIovec(url, strlen(url)));
+  iov.push_back(makeIovec(http, strlen(http)));
   for (unsigned i=0; i<headers.size(); i++) {
-    e = WriteString(headers[i] + CRLF);
-    if (e.error)
-      return e;
+    iov.push_back(makeIovec(headers[i].c_str(), headers[i].length()));
+    iov.push_back(makeIovec(CRLF.c_str(), CRLF.length()));
   }
+  iov.push_back(makeIovec(CRLF.c_str(), CRLF.length()));
 
-  e = WriteString(CRLF);
+  e = WriteVector(&iov[0], iov.size());
   if (e.error)
     return e;
 
@@ -902,35 +1571,29 @@ KOtcpError KOtcpConnection::HttpPost(const std::vector<std::string>& headers, co
       return e;
   }
 
-  std::string get;
-  get += "POST ";
-  get += url;
-  get += " HTTP/1.1";
-  get += CRLF;
-
-  e = WriteString(get);
-  if (e.error)
-    return e;
+  // the whole request goes out with a single sendmsg()
 
-  for (unsigned i=0; i<headers.size(); i++) {
-    e = WriteString(headers[i] + CRLF);
-    if (e.error)
-      return e;
-  }
+  const char* post = "POST ";
+  const char* http = " HTTP/1.1\r\n";
 
   std::string cl;
   cl += "Content-Length: ";
   cl += toString(body_length);
+  cl += CRLF;
 
-  e = WriteString(cl + CRLF);
-  if (e.error)
-    return e;
-
-  e = WriteString(CRLF);
-  if (e.error)
-    return e;
+  std::vector<struct iovec> iov;
+  iov.push_back(makeIovec(post, strlen(post)));
+  iov.push_back(makeIovec(url, strlen(url)));
+  iov.push_back(makeIovec(http, strlen(http)));
+  for (unsigned i=0; i<headers.size(); i++) {
+    iov.push_back(makeIovec(headers[i].c_str(), headers[i].length()));
+    iov.push_back(makeIovec(CRLF.c_str(), CRLF.length()));
+  }
+  iov.push_back(makeIovec(cl.c_str(), cl.length()));
+  iov.push_back(makeIovec(CRLF.c_str(), CRLF.length()));
+  iov.push_back(makeIovec(body, body_length));
 
-  e = WriteBytes(body, body_length);
+  e = WriteVector(&iov[0], iov.size());
   if (e.error)
     return e;
 
@@ -941,6 +1604,159 @@ KOtcpError KOtcpConnection::HttpPost(const std::vector<std::string>& headers, co
   return KOtcpError();
 }
 
+////////////////////////////////////////////////////////////
+//                                                        //
+//                 KOtcpReactor methods                   //
+//                                                        //
+////////////////////////////////////////////////////////////
+
+KOtcpReactor::KOtcpReactor() // ctor
+{
+  fEpollFd = epoll_create1(EPOLL_CLOEXEC);
+}
+
+KOtcpReactor::~KOtcpReactor() // dtor
+{
+  if (fEpollFd >= 0) {
+    ::close(fEpollFd);
+    fEpollFd = -1;
+  }
+}
+
+static uint32_t epollEvents(bool want_write)
+{
+  uint32_t events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+  if (want_write)
+    events |= EPOLLOUT;
+  return events;
+}
+
+KOtcpError KOtcpReactor::Add(KOtcpConnection* conn, KOtcpHandler* handler, bool want_write)
+{
+  if (fEpollFd < 0) {
+    return KOtcpError("KOtcpReactor::Add()", "epoll_create1() failed");
+  }
+
+  if (!conn->fConnected) {
+    return KOtcpError("KOtcpReactor::Add()", "Not connected");
+  }
+
+  if (conn->fShm) {
+    return KOtcpError("KOtcpReactor::Add()", "shared memory connections have no file descriptor");
+  }
+
+  if (conn->fUring) {
+    return KOtcpError("KOtcpReactor::Add()", "io_uring connections are not polled");
+  }
+
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = epollEvents(want_write);
+  ev.data.fd = conn->fSocket;
+
+  int ret = epoll_ctl(fEpollFd, EPOLL_CTL_ADD, conn->fSocket, &ev);
+  if (ret < 0) {
+    return KOtcpError("KOtcpReactor::Add()", errno, "epoll_ctl(EPOLL_CTL_ADD) error");
+  }
+
+  fConnections[conn->fSocket] = std::make_pair(conn, handler);
+
+  // data may already be waiting in the connection buffer or socket,
+  // an edge-triggered epoll would not report it
+  int nbytes = 0;
+  bool closed = false;
+  conn->ReadAvailable(&nbytes, &closed);
+  if (conn->fBufUsed > conn->fBufPtr)
+    handler->HandleReadable(conn);
+
+  return KOtcpError();
+}
+
+KOtcpError KOtcpReactor::SetWantWrite(KOtcpConnection* conn, bool want_write)
+{
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = epollEvents(want_write);
+  ev.data.fd = conn->fSocket;
+
+  int ret = epoll_ctl(fEpollFd, EPOLL_CTL_MOD, conn->fSocket, &ev);
+  if (ret < 0) {
+    return KOtcpError("KOtcpReactor::SetWantWrite()", errno, "epoll_ctl(EPOLL_CTL_MOD) error");
+  }
+
+  return KOtcpError();
+}
+
+KOtcpError KOtcpReactor::Remove(KOtcpConnection* conn)
+{
+  if (fConnections.erase(conn->fSocket) == 0) {
+    return KOtcpError("KOtcpReactor::Remove()", "connection not registered");
+  }
+
+  int ret = epoll_ctl(fEpollFd, EPOLL_CTL_DEL, conn->fSocket, NULL);
+  if (ret < 0) {
+    return KOtcpError("KOtcpReactor::Remove()", errno, "epoll_ctl(EPOLL_CTL_DEL) error");
+  }
+
+  return KOtcpError();
+}
+
+KOtcpError KOtcpReactor::Poll(int timeout_millisec, int *nevents)
+{
+  *nevents = 0;
+
+  if (fEpollFd < 0) {
+    return KOtcpError("KOtcpReactor::Poll()", "epoll_create1() failed");
+  }
+
+  std::vector<struct epoll_event> events(fMaxEvents);
+
+  int ret = epoll_wait(fEpollFd, &events[0], fMaxEvents, timeout_millisec);
+
+  if (ret < 0) {
+    if (errno == EINTR) // alarm signal from midas watchdog
+      return KOtcpError();
+    return KOtcpError("KOtcpReactor::Poll()", errno, "epoll_wait() error");
+  }
+
+  for (int i=0; i<ret; i++) {
+    // handlers may remove connections, look them up every time
+    std::map<int, std::pair<KOtcpConnection*, KOtcpHandler*> >::iterator it = fConnections.find(events[i].data.fd);
+    if (it == fConnections.end())
+      continue;
+
+    KOtcpConnection* conn = it->second.first;
+    KOtcpHandler* handler = it->second.second;
+    uint32_t ev = events[i].events;
+    bool closed = (ev & (EPOLLERR|EPOLLHUP)) != 0;
+
+    if (ev & (EPOLLIN|EPOLLRDHUP)) {
+      int nbytes = 0;
+      bool eof = false;
+      KOtcpError e = conn->ReadAvailable(&nbytes, &eof);
+      if (e.error || eof)
+	closed = true;
+      if (conn->fBufUsed > conn->fBufPtr)
+	handler->HandleReadable(conn);
+      if (fConnections.find(events[i].data.fd) == fConnections.end())
+	continue; // removed by the handler
+    }
+
+    if (!closed && (ev & EPOLLOUT)) {
+      handler->HandleWritable(conn);
+    }
+
+    if (closed) {
+      Remove(conn);
+      handler->HandleClosed(conn);
+    }
+
+    (*nevents)++;
+  }
+
+  return KOtcpError();
+}
+
 #ifdef MAIN
 
 int main(int argc, char* argv[])
@@ -10,10 +10,17 @@
 #define KOtcpH
 
 #include <string>
+#include <string_view>
 #include <vector>
+#include <map>
 
 typedef unsigned int KOtcpType;
 
+struct iovec; // <sys/uio.h>
+struct pollfd; // <poll.h>
+class KOshmChannel; // KOshm.h
+class KOuring; // KOuring.h
+
 class KOtcpError
 {
  public:
@@ -26,6 +33,10 @@ class KOtcpError
     KOtcpError(const char* func, int xerrno, const char* text);
 };
 
+// Endpoints: fHostname is a host name or address with fService the port,
+// "unix:/path" for an AF_UNIX stream socket or "shm:name" for a shared
+// memory ring pair (KOshm.h), fService is ignored for the last two.
+
 class KOtcpConnection
 {
  public: // status flags
@@ -34,13 +45,29 @@ class KOtcpConnection
     std::string fService;
 
  public: // settings
-    int fConnectTimeoutMilliSec = 5000;
+    int fConnectTimeoutMilliSec = 5000; // for all addresses of fHostname together
+    int fConnectStaggerMilliSec = 250; // delay before racing the next address
     int fReadTimeoutMilliSec = 5000;
     int fWriteTimeoutMilliSec = 5000;
+    int fMinReadTimeoutMilliSec = 0; // limits of the adaptive read timeout, see AddRttSample()
+    int fMaxReadTimeoutMilliSec = 0; // 0 keeps fReadTimeoutMilliSec fixed
+    int fSendHighWater = 1024*1024; // writes block while more than this is queued
+    int fKeepAliveSec = 0; // SO_KEEPALIVE idle time before the first probe, 0 to disable
+    int fKeepAliveIntervalSec = 1; // time between keepalive probes
+    int fKeepAliveCount = 5; // unanswered probes before the connection is dropped
+    int fUserTimeoutMilliSec = 0; // TCP_USER_TIMEOUT for unacknowledged data, 0 for the system default
+    bool fShmCreate = false; // "shm:" endpoint: create the segment, i.e. act as the server side
+    bool fUseUring = false; // socket I/O through io_uring (KOuring.h) if the kernel supports it
     bool fHttpKeepOpen = true;
+    double fDeadline = 0; // Now() time at which every wait times out, 0 for none
 
  public: // state
     int fSocket = -1;
+    int fFamily = 0; // AF_INET, AF_INET6 or AF_UNIX, 0 for shared memory
+    KOshmChannel* fShm = NULL; // "shm:" endpoint, fSocket is not used
+    KOuring* fUring = NULL; // io_uring in use for fSocket, NULL for poll() and plain system calls
+    double fSrtt = 0; // smoothed round trip time in seconds, 0 before the first sample
+    double fRttVar = 0; // round trip time variation in seconds
 
  public: // public api
     KOtcpConnection(const char* hostname, const char* service); // ctor
@@ -54,8 +81,24 @@ class KOtcpConnection
 
     KOtcpError WriteString(const std::string& s);
     KOtcpError WriteBytes(const char* ptr, int len);
+    KOtcpError WriteVector(const struct iovec* iov, int iovcnt); // gather write, one sendmsg()
+    KOtcpError SetCork(bool cork); // TCP_CORK, hold partial packets until uncorked
+    KOtcpError SetKeepAlive(); // apply fKeepAlive* and fUserTimeoutMilliSec, done by Connect()
+    KOtcpError QueueString(const std::string& s); // queue without sending, sent by Flush() or the next read
+    KOtcpError QueueBytes(const char* ptr, int len);
+    KOtcpError Flush(bool wait, bool more = false); // send queued data, optionally wait until all is sent, more: a read follows at once
+    int SendQueued() const;
+
+    static double Now(); // CLOCK_MONOTONIC time in seconds
+    void AddRttSample(double rtt); // request to reply time in seconds, updates the adaptive read timeout
+    void RttBackoff(); // double the adaptive read timeout after a timeout
+    bool DeadlineExpired() const;
 
     KOtcpError ReadString(std::string* s, unsigned max_length);
+    KOtcpError ReadAvailable(int *nbytes, bool *closed); // non-blocking, drain socket into buffer
+    KOtcpError ReadStringView(std::string_view* s, unsigned max_length); // no copy, valid until the next read
+    bool GetBufferedString(std::string* s); // complete line from buffer, never reads the socket
+    bool GetBufferedStringView(std::string_view* s); // same, no copy, valid until the next read
     KOtcpError ReadHttpHeader(std::string* s);
     KOtcpError ReadBytes(char* ptr, int len);
 
@@ -72,6 +115,45 @@ class KOtcpConnection
     bool CopyBuf(std::string *s);
     bool CopyBufHttp(std::string *s);
     KOtcpError ReadBuf();
+    void PrepareBuf();
+    KOtcpError WaitReadable(int wait_time_millisec, bool *readable); // poll() only, no FIONREAD
+    KOtcpError PollSocket(short events, int wait_time_millisec, bool *ready);
+    int PollWait(struct pollfd* pfd, int nfds, int wait_time_millisec); // poll() bounded by fDeadline, restarted after signals
+    int RecvVector(const struct iovec* iov, int iovcnt); // non-blocking readv() on the socket or shared memory
+    int SendVector(const struct iovec* iov, int iovcnt, bool more = false); // non-blocking sendmsg() on the socket or shared memory, more: io_uring submits with the next wait
+    void EnableUring(); // switch to io_uring if fUseUring is set and the kernel supports it
+    KOtcpError ConnectUnix(const std::string& path);
+    KOtcpError ConnectShm(const std::string& name);
+    std::string fSendBuf; // send queue
+    size_t fSendPtr = 0; // first unsent byte in send queue
+};
+
+class KOtcpHandler
+{
+ public:
+    virtual ~KOtcpHandler() {}; // dtor
+    virtual void HandleReadable(KOtcpConnection* conn) = 0; // new data is in the connection buffer
+    virtual void HandleWritable(KOtcpConnection* conn) {}; // socket has write space
+    virtual void HandleClosed(KOtcpConnection* conn) {}; // peer closed or socket error, connection is removed from reactor
+};
+
+class KOtcpReactor
+{
+ public: // settings
+    int fMaxEvents = 64;
+
+ public: // state
+    int fEpollFd = -1;
+    std::map<int, std::pair<KOtcpConnection*, KOtcpHandler*> > fConnections;
+
+ public: // public api
+    KOtcpReactor(); // ctor
+    ~KOtcpReactor(); // dtor
+
+    KOtcpError Add(KOtcpConnection* conn, KOtcpHandler* handler, bool want_write = false);
+    KOtcpError SetWantWrite(KOtcpConnection* conn, bool want_write);
+    KOtcpError Remove(KOtcpConnection* conn);
+    KOtcpError Poll(int timeout_millisec, int *nevents);
 };
 
 #endif
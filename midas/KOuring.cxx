@@ -0,0 +1,529 @@
+//
+// Name: KOuring.cxx
+// Description: io_uring I/O for KOtcpConnection sockets
+//
+// Talks to the kernel through the raw system calls, liburing is not needed.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h> // POLLIN, POLLOUT
+#include <stdint.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h> // MSG_NOSIGNAL
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "KOuring.h"
+
+// IORING_RECV_MULTISHOT and IORING_REGISTER_PBUF_RING arrived with
+// linux 6.0 and 5.19, older headers build without io_uring support
+
+#if defined(IORING_RECV_MULTISHOT) && defined(__NR_io_uring_setup)
+#define KOURING_AVAILABLE 1
+#endif
+
+#define KOURING_RECV 1 // user_data of the completions
+#define KOURING_SEND 2
+
+KOuring::~KOuring() // dtor
+{
+  Close();
+}
+
+#ifdef KOURING_AVAILABLE
+
+static int uringSetup(unsigned entries, struct io_uring_params* p)
+{
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uringEnter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, const void* arg, size_t argsz)
+{
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int uringRegister(int fd, unsigned opcode, const void* arg, unsigned nr_args)
+{
+  return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+bool KOuring::Supported()
+{
+  static int supported = -1;
+  if (supported < 0) {
+    KOuring u;
+    u.fEntries = 2;
+    u.fBufCount = 1;
+    u.fBufSize = 64;
+    supported = u.Setup().error ? 0 : 1;
+  }
+  return supported;
+}
+
+KOtcpError KOuring::Setup()
+{
+  if (fBufCount == 0 || fBufCount > 32768 || (fBufCount & (fBufCount - 1)) != 0) {
+    return KOtcpError("KOuring::Setup()", "buffer count must be a power of two up to 32768");
+  }
+
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  int fd = uringSetup(fEntries, &p);
+  if (fd < 0) {
+    return KOtcpError("KOuring::Setup()", errno, "io_uring_setup() error");
+  }
+  fRingFd = fd;
+
+  // one mapping for both rings and timeouts passed with io_uring_enter()
+
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG)) {
+    Close();
+    return KOtcpError("KOuring::Setup()", "kernel io_uring is too old");
+  }
+
+  size_t sq_size = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+  size_t cq_size = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+  fRingSize = (sq_size > cq_size) ? sq_size : cq_size;
+
+  void* ptr = mmap(NULL, fRingSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (ptr == MAP_FAILED) {
+    int e = errno;
+    Close();
+    return KOtcpError("KOuring::Setup()", e, "mmap(rings) error");
+  }
+  fRingPtr = ptr;
+
+  fSqesSize = p.sq_entries*sizeof(struct io_uring_sqe);
+  ptr = mmap(NULL, fSqesSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (ptr == MAP_FAILED) {
+    int e = errno;
+    Close();
+    return KOtcpError("KOuring::Setup()", e, "mmap(sqes) error");
+  }
+  fSqes = (struct io_uring_sqe*)ptr;
+
+  char* ring = (char*)fRingPtr;
+  fSqHead  = (unsigned*)(ring + p.sq_off.head);
+  fSqTail  = (unsigned*)(ring + p.sq_off.tail);
+  fSqMask  = (unsigned*)(ring + p.sq_off.ring_mask);
+  fSqArray = (unsigned*)(ring + p.sq_off.array);
+  fCqHead  = (unsigned*)(ring + p.cq_off.head);
+  fCqTail  = (unsigned*)(ring + p.cq_off.tail);
+  fCqMask  = (unsigned*)(ring + p.cq_off.ring_mask);
+  fCqes    = (struct io_uring_cqe*)(ring + p.cq_off.cqes);
+
+  // the operations used here, multishot receive is checked by Init()
+
+  size_t probe_size = sizeof(struct io_uring_probe) + 256*sizeof(struct io_uring_probe_op);
+  std::string probe_buf(probe_size, 0);
+  struct io_uring_probe* probe = (struct io_uring_probe*)&probe_buf[0];
+  if (uringRegister(fd, IORING_REGISTER_PROBE, probe, 256) < 0
+      || probe->last_op < IORING_OP_RECV
+      || !(probe->ops[IORING_OP_SEND].flags & IO_URING_OP_SUPPORTED)
+      || !(probe->ops[IORING_OP_RECV].flags & IO_URING_OP_SUPPORTED)) {
+    Close();
+    return KOtcpError("KOuring::Setup()", "kernel io_uring has no send and receive");
+  }
+
+  // receive buffers, handed to the kernel through a registered ring
+
+  fBufRingSize = fBufCount*sizeof(struct io_uring_buf);
+  ptr = mmap(NULL, fBufRingSize + (size_t)fBufCount*fBufSize, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (ptr == MAP_FAILED) {
+    int e = errno;
+    Close();
+    return KOtcpError("KOuring::Setup()", e, "mmap(buffers) error");
+  }
+  fBufRing = (struct io_uring_buf_ring*)ptr;
+  fBufs = (char*)ptr + fBufRingSize;
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uintptr_t)fBufRing;
+  reg.ring_entries = fBufCount;
+  reg.bgid = 0;
+  if (uringRegister(fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+    int e = errno;
+    Close();
+    return KOtcpError("KOuring::Setup()", e, "io_uring_register(PBUF_RING) error");
+  }
+
+  for (unsigned i=0; i<fBufCount; i++)
+    Recycle(i);
+
+  return KOtcpError();
+}
+
+KOtcpError KOuring::Init(int socket)
+{
+  if (fRingFd >= 0) {
+    return KOtcpError("KOuring::Init()", "already initialized");
+  }
+
+  KOtcpError e = Setup();
+  if (e.error) {
+    return e;
+  }
+
+  // the kernel waits for data, a non-blocking socket would make it fail with EAGAIN instead
+
+  int flags = fcntl(socket, F_GETFL);
+  if (flags < 0 || fcntl(socket, F_SETFL, flags & ~O_NONBLOCK) < 0) {
+    int e = errno;
+    Close();
+    return KOtcpError("KOuring::Init()", e, "fcntl(O_NONBLOCK) error");
+  }
+
+  fSocket = socket;
+  PrepareRecv();
+  Submit();
+
+  // kernels before 6.0 reject the multishot flag at once
+
+  Reap();
+  if (fError == EINVAL) {
+    Close();
+    fcntl(socket, F_SETFL, flags);
+    return KOtcpError("KOuring::Init()", "kernel io_uring has no multishot receive");
+  }
+
+  return KOtcpError();
+}
+
+void KOuring::Close()
+{
+  if (fRingFd < 0)
+    return;
+
+  // data handed to Write() should not be lost when the connection is closed right after
+
+  Submit();
+  double end = KOtcpConnection::Now() + 1.0;
+  while (fSqTail && fSendInFlight && !fError && KOtcpConnection::Now() < end) {
+    Enter(1, end);
+    Reap();
+  }
+
+  // closing the ring cancels the receive before its buffers go away
+
+  ::close(fRingFd);
+  fRingFd = -1;
+
+  if (fBufRing)
+    munmap(fBufRing, fBufRingSize + (size_t)fBufCount*fBufSize);
+  if (fSqes)
+    munmap(fSqes, fSqesSize);
+  if (fRingPtr)
+    munmap(fRingPtr, fRingSize);
+
+  fBufRing = NULL;
+  fBufs = NULL;
+  fSqes = NULL;
+  fRingPtr = NULL;
+  fSqHead = fSqTail = fSqMask = fSqArray = NULL;
+  fCqHead = fCqTail = fCqMask = NULL;
+  fCqes = NULL;
+  fRecvd.clear();
+  fRecvArmed = false;
+  fSendInFlight = false;
+}
+
+struct io_uring_sqe* KOuring::GetSqe()
+{
+  // the queue is only full if nothing was submitted for a while
+
+  if (*fSqTail - __atomic_load_n(fSqHead, __ATOMIC_ACQUIRE) > *fSqMask)
+    Submit();
+
+  unsigned idx = *fSqTail & *fSqMask;
+  struct io_uring_sqe* sqe = &fSqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  fSqArray[idx] = idx;
+  return sqe;
+}
+
+void KOuring::PushSqe()
+{
+  __atomic_store_n(fSqTail, *fSqTail + 1, __ATOMIC_RELEASE);
+}
+
+void KOuring::PrepareRecv()
+{
+  struct io_uring_sqe* sqe = GetSqe();
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = fSocket;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = 0;
+  sqe->user_data = KOURING_RECV;
+  PushSqe();
+  fRecvArmed = true;
+}
+
+void KOuring::PrepareSend()
+{
+  struct io_uring_sqe* sqe = GetSqe();
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = fSocket;
+  sqe->addr = (uintptr_t)(fSending.data() + fSendingDone);
+  sqe->len = fSending.size() - fSendingDone;
+  sqe->msg_flags = MSG_NOSIGNAL|MSG_WAITALL;
+  sqe->user_data = KOURING_SEND;
+  PushSqe();
+  fSendInFlight = true;
+}
+
+void KOuring::Recycle(unsigned bid)
+{
+  // not fBufRing->bufs[], its empty struct member takes a byte in C++ and shifts the array
+
+  struct io_uring_buf* buf = (struct io_uring_buf*)fBufRing + (fBufTail & (fBufCount - 1));
+  buf->addr = (uintptr_t)(fBufs + (size_t)bid*fBufSize);
+  buf->len = fBufSize;
+  buf->bid = bid;
+  fBufTail++;
+  fNoBufs = false;
+  __atomic_store_n(&fBufRing->tail, fBufTail, __ATOMIC_RELEASE);
+}
+
+// submit what was prepared, with min_complete > 0 also wait for that
+// many completions, at most until the monotonic time end
+
+int KOuring::Enter(unsigned min_complete, double end)
+{
+  unsigned to_submit = *fSqTail - __atomic_load_n(fSqHead, __ATOMIC_ACQUIRE);
+  if (to_submit == 0 && min_complete == 0)
+    return 0;
+
+  if (min_complete == 0)
+    return uringEnter(fRingFd, to_submit, 0, 0, NULL, 0);
+
+  double remaining = end - KOtcpConnection::Now();
+  if (remaining < 0)
+    remaining = 0;
+
+  struct __kernel_timespec ts;
+  ts.tv_sec = (long long)remaining;
+  ts.tv_nsec = (long long)((remaining - ts.tv_sec)*1e9);
+
+  struct io_uring_getevents_arg arg;
+  memset(&arg, 0, sizeof(arg));
+  arg.ts = (uintptr_t)&ts;
+
+  return uringEnter(fRingFd, to_submit, min_complete, IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+}
+
+void KOuring::Submit()
+{
+  if (fSqTail)
+    Enter(0, 0);
+}
+
+void KOuring::Reap()
+{
+  unsigned head = *fCqHead;
+  unsigned tail = __atomic_load_n(fCqTail, __ATOMIC_ACQUIRE);
+
+  for (; head != tail; head++) {
+    const struct io_uring_cqe* cqe = &fCqes[head & *fCqMask];
+
+    if (cqe->user_data == KOURING_RECV) {
+      if (cqe->res > 0) {
+	Chunk c;
+	c.bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+	c.off = 0;
+	c.len = cqe->res;
+	fRecvd.push_back(c);
+      } else if (cqe->res == 0) {
+	fEof = true;
+      } else if (cqe->res == -ENOBUFS) {
+	fNoBufs = true; // rearmed once Read() gives buffers back
+      } else {
+	fError = -cqe->res;
+      }
+      if (!(cqe->flags & IORING_CQE_F_MORE))
+	fRecvArmed = false;
+    } else if (cqe->user_data == KOURING_SEND) {
+      fSendInFlight = false;
+      if (cqe->res < 0) {
+	fError = -cqe->res;
+	fSending.clear();
+	fQueued.clear();
+	fSendingDone = 0;
+      } else {
+	fSendingDone += cqe->res;
+	if (fSendingDone == fSending.size()) {
+	  fSending.swap(fQueued);
+	  fQueued.clear();
+	  fSendingDone = 0;
+	}
+	if (fSending.size() > fSendingDone)
+	  PrepareSend();
+      }
+    }
+  }
+
+  __atomic_store_n(fCqHead, head, __ATOMIC_RELEASE);
+
+  if (!fRecvArmed && !fEof && !fError && !fNoBufs)
+    PrepareRecv();
+}
+
+size_t KOuring::Unsent() const
+{
+  return fSending.size() - fSendingDone + fQueued.size();
+}
+
+int KOuring::Available()
+{
+  if (fRingFd < 0)
+    return 0;
+
+  Reap();
+
+  int n = 0;
+  for (const Chunk& c : fRecvd)
+    n += c.len - c.off;
+  return n;
+}
+
+int KOuring::Read(const struct iovec* iov, int iovcnt)
+{
+  if (fRingFd < 0) {
+    errno = EBADF;
+    return -1;
+  }
+
+  Reap();
+
+  if (fRecvd.empty()) {
+    if (fError) {
+      errno = fError;
+      return -1;
+    }
+    if (fEof)
+      return 0;
+    errno = EAGAIN;
+    return -1;
+  }
+
+  int done = 0;
+  for (int i = 0; i < iovcnt && !fRecvd.empty(); i++) {
+    size_t pos = 0;
+    while (pos < iov[i].iov_len && !fRecvd.empty()) {
+      Chunk& c = fRecvd.front();
+      size_t n = c.len - c.off;
+      if (n > iov[i].iov_len - pos)
+	n = iov[i].iov_len - pos;
+      memcpy((char*)iov[i].iov_base + pos, fBufs + (size_t)c.bid*fBufSize + c.off, n);
+      c.off += n;
+      pos += n;
+      if (c.off == c.len) {
+	Recycle(c.bid);
+	fRecvd.pop_front();
+      }
+    }
+    done += pos;
+  }
+
+  if (!fRecvArmed && !fEof && !fError && !fNoBufs)
+    PrepareRecv();
+
+  return done;
+}
+
+int KOuring::Write(const struct iovec* iov, int iovcnt)
+{
+  if (fRingFd < 0) {
+    errno = EBADF;
+    return -1;
+  }
+
+  if (fError) {
+    errno = fError;
+    return -1;
+  }
+
+  size_t unsent = Unsent();
+  if (unsent >= (size_t)fSendHighWater) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  // the buffer of a send in flight must stay where it is
+
+  std::string& buf = fSendInFlight ? fQueued : fSending;
+  size_t space = fSendHighWater - unsent;
+  size_t done = 0;
+  for (int i = 0; i < iovcnt && done < space; i++) {
+    size_t n = iov[i].iov_len;
+    if (n > space - done)
+      n = space - done;
+    buf.append((const char*)iov[i].iov_base, n);
+    done += n;
+  }
+
+  if (!fSendInFlight)
+    PrepareSend();
+
+  return done;
+}
+
+short KOuring::Wait(short events, double end)
+{
+  if (fRingFd < 0)
+    return POLLHUP;
+
+  // a prepared send goes out with the same io_uring_enter() that waits for the reply
+
+  while (1) {
+    Reap();
+
+    short revents = 0;
+    if ((events & POLLIN) && !fRecvd.empty())
+      revents |= POLLIN;
+    if ((events & POLLOUT) && Unsent() < (size_t)fSendHighWater)
+      revents |= POLLOUT;
+    if (fEof || fError)
+      revents |= POLLHUP;
+
+    if (revents || KOtcpConnection::Now() >= end) {
+      Submit();
+      return revents;
+    }
+
+    int ret = Enter(1, end);
+    if (ret < 0 && errno != ETIME && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+      fError = errno;
+    }
+  }
+}
+
+#else // KOURING_AVAILABLE
+
+bool KOuring::Supported()
+{
+  return false;
+}
+
+KOtcpError KOuring::Init(int socket)
+{
+  return KOtcpError("KOuring::Init()", "built without io_uring support");
+}
+
+void KOuring::Close() {}
+int KOuring::Read(const struct iovec* iov, int iovcnt) { errno = EBADF; return -1; }
+int KOuring::Write(const struct iovec* iov, int iovcnt) { errno = EBADF; return -1; }
+int KOuring::Available() { return 0; }
+void KOuring::Submit() {}
+short KOuring::Wait(short events, double end) { return POLLHUP; }
+
+#endif // KOURING_AVAILABLE
+
+// end file
@@ -0,0 +1,87 @@
+//
+// Name: KOuring.h
+// Description: io_uring I/O for KOtcpConnection sockets
+//
+// A multishot receive stays armed on the socket and fills buffers taken
+// from a ring of provided buffers, so arriving data is collected without
+// a system call per read. A send is submitted together with the wait for
+// its reply. Only used if the running kernel has everything needed, see
+// Supported(), KOtcpConnection falls back to poll() otherwise.
+//
+
+#ifndef KOuringH
+#define KOuringH
+
+#include <string>
+#include <deque>
+
+#include "KOtcp.h"
+
+struct iovec; // <sys/uio.h>
+struct io_uring_sqe; // <linux/io_uring.h>
+struct io_uring_cqe;
+struct io_uring_buf_ring;
+
+class KOuring
+{
+ public: // settings
+    unsigned fEntries = 8; // submission queue size
+    unsigned fBufCount = 64; // provided receive buffers, power of two
+    unsigned fBufSize = 16*1024; // bytes per receive buffer
+    int fSendHighWater = 1024*1024; // Write() takes no more unsent data than this
+
+ public: // state
+    int fRingFd = -1;
+    int fSocket = -1;
+    void* fRingPtr = NULL; // submission and completion rings, one mapping
+    size_t fRingSize = 0;
+    struct io_uring_sqe* fSqes = NULL;
+    size_t fSqesSize = 0;
+    unsigned *fSqHead = NULL, *fSqTail = NULL, *fSqMask = NULL, *fSqArray = NULL;
+    unsigned *fCqHead = NULL, *fCqTail = NULL, *fCqMask = NULL;
+    struct io_uring_cqe* fCqes = NULL;
+    struct io_uring_buf_ring* fBufRing = NULL;
+    size_t fBufRingSize = 0;
+    char* fBufs = NULL;
+    unsigned short fBufTail = 0; // next free slot of the buffer ring
+    bool fRecvArmed = false; // multishot receive is active
+    bool fNoBufs = false; // receive stopped, all buffers hold unread data
+    bool fEof = false; // peer closed
+    int fError = 0; // errno of a failed receive or send
+    struct Chunk { unsigned bid, off, len; };
+    std::deque<Chunk> fRecvd; // received data, in buffers not yet given back
+    std::string fSending; // being sent, must not move until the send completes
+    size_t fSendingDone = 0;
+    std::string fQueued; // written while a send is in flight
+    bool fSendInFlight = false;
+
+ public: // public api
+    ~KOuring(); // dtor
+
+    static bool Supported(); // kernel has io_uring with everything used here, tested once
+    KOtcpError Init(int socket); // socket becomes blocking, io_uring does the waiting
+    void Close(); // waits briefly for a send in flight
+
+    // socket-like calls as in KOshmChannel. Write() only prepares the
+    // send, it goes out with the next Submit() or Wait()
+
+    int Read(const struct iovec* iov, int iovcnt);
+    int Write(const struct iovec* iov, int iovcnt);
+    int Available();
+    void Submit();
+    short Wait(short events, double end);
+
+ public: // internal stuff
+    KOtcpError Setup();
+    struct io_uring_sqe* GetSqe();
+    void PushSqe();
+    void PrepareRecv();
+    void PrepareSend();
+    int Enter(unsigned min_complete, double end);
+    void Reap();
+    void Recycle(unsigned bid);
+    size_t Unsent() const;
+};
+
+#endif
+// end file
@@ -8,8 +8,11 @@
 #include <signal.h> // SIGPIPE
 #include <assert.h> // assert()
 #include <stdlib.h> // malloc()
+#include <string.h> // memcpy()
+#include <unistd.h> // getpid()
+#include <math.h> // fabs(), isnan()
+#include <float.h> // DBL_EPSILON
 #include <iostream>
-#include <iomanip>              // to change stream formatting
 #include <sstream>
 #include <fstream>
 #include <string>
@@ -19,6 +22,13 @@
 #include <set>
 #include <limits>
 #include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <deque>
+#include <variant>
+#include <charconv> // to_chars(), from_chars()
+#include <string_view>
+#include <type_traits> // is_same_v
 
 #include "midas.h"
 #include "msystem.h"
@@ -37,28 +47,199 @@ using std::endl;
 #define VARSEPARATOR ";"
 #define VALSEPARATOR ":"
 
+// Binary protocol: each frame is a 32 bit big-endian length followed by the payload.
+// Payloads start with one of the opcodes below, variables are addressed by their
+// 16 bit position in the list:vars reply, values are a MIDAS TID byte followed by
+// the big-endian value (strings: 16 bit length and characters).
+#define BINVERSION "binary/1"
+#define BINREAD  'R'            // BINREAD  n id_1 ... id_n
+#define BINWRITE 'W'            // BINWRITE id tid value
+#define BINVALUE 'V'            // BINVALUE n id_1 tid_1 value_1 ... id_n tid_n value_n
+
 /**
- * \brief helper function to split a string into a vector of strings
+ * \brief helper class to split text into records and fields without copying
+ *
+ * Records end at \p outer, fields within a record at \p inner, both are found in the
+ * same pass. Results are string_views into the original text, which has to outlive
+ * them. Empty records and fields are skipped.
  */
-vector<string> split(const string& str, const string& delim)
+class Tokenizer
 {
-   vector<string> tokens;
-   size_t prev = 0, pos = 0;
-   do
-      {
-         pos = str.find(delim, prev);
-         if (pos == string::npos) pos = str.length();
-         string token = str.substr(prev, pos-prev);
-         if (!token.empty()) tokens.push_back(token);
-         prev = pos + delim.length();
+public:
+   Tokenizer(std::string_view str, char outer, char inner = 0): fRest(str), fOuter(outer), fInner(inner ? inner : outer) {}
+
+   /** \brief Split the next record into at most \p max fields.
+    *
+    * Returns the number of fields of the record, which may be larger than \p max,
+    * 0 after the last record.
+    */
+   int Next(std::string_view *fields, int max)
+   {
+      while(fRest.size()){
+         int n = 0;
+         size_t start = 0, i = 0;
+         for(; i < fRest.size() && fRest[i] != fOuter; i++){
+            if(fRest[i] == fInner){
+               if(i > start && n++ < max) fields[n-1] = fRest.substr(start, i - start);
+               start = i + 1;
+            }
+         }
+         if(i > start && n++ < max) fields[n-1] = fRest.substr(start, i - start);
+         fRecord = fRest.substr(0, i);
+         fRest.remove_prefix(i < fRest.size() ? i + 1 : i);
+         if(n) return n;
       }
-   while (pos < str.length() && prev < str.length());
-   return tokens;
+      return 0;
+   }
+
+   /** \brief Next record as a whole. */
+   bool Next(std::string_view &record)
+   {
+      if(!Next(&record, 0)) return false;
+      record = fRecord;
+      return true;
+   }
+
+   /** \brief Number of records left, without consuming them. */
+   int Count() const
+   {
+      Tokenizer t(*this);
+      std::string_view r;
+      int n = 0;
+      while(t.Next(r)) n++;
+      return n;
+   }
+
+   /** \brief The complete record last returned by Next(). */
+   std::string_view Record() const { return fRecord; }
+
+private:
+   std::string_view fRest, fRecord;
+   char fOuter, fInner;
+};
+
+/**
+ * \brief helper function to append a value in network byte order
+ */
+template <class T>
+void PutBE(string &buf, const T val)
+{
+   unsigned char b[sizeof(T)];
+   memcpy(b, &val, sizeof(T));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+   std::reverse(b, b + sizeof(T));
+#endif
+   buf.append((const char*)b, sizeof(T));
+}
+
+/**
+ * \brief helper function to extract a value in network byte order, advances \p p
+ */
+template <class T>
+bool GetBE(const char *&p, const char *end, T &val)
+{
+   if(end - p < (long)sizeof(T)) return false;
+   unsigned char b[sizeof(T)];
+   memcpy(b, p, sizeof(T));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+   std::reverse(b, b + sizeof(T));
+#endif
+   memcpy(&val, b, sizeof(T));
+   p += sizeof(T);
+   return true;
+}
+
+/**
+ * \brief helper function to append a value as text, no locale, no allocation besides \p buf
+ */
+template <class T>
+void PutText(string &buf, const T val)
+{
+   char tmp[24];
+   std::to_chars_result r = std::to_chars(tmp, tmp + sizeof(tmp), val);
+   buf.append(tmp, r.ptr);
+}
+
+void PutText(string &buf, const bool val)
+{
+   buf += val ? '1' : '0';
+}
+
+void PutText(string &buf, const string &val)
+{
+   buf += val;
+}
+
+/**
+ * \brief helper function to append a floating point value as text
+ *
+ * Uses the shortest fixed notation that reads back to exactly \p val,
+ * LabView does not understand scientific notation.
+ */
+void PutText(string &buf, const double val)
+{
+   char tmp[DBL_MAX_10_EXP + 32];
+   std::to_chars_result r = std::to_chars(tmp, tmp + sizeof(tmp), val, std::chars_format::fixed);
+   buf.append(tmp, r.ptr);
+}
+
+void PutText(string &buf, const float val)
+{
+   char tmp[FLT_MAX_10_EXP + 32];
+   std::to_chars_result r = std::to_chars(tmp, tmp + sizeof(tmp), val, std::chars_format::fixed);
+   buf.append(tmp, r.ptr);
+}
+
+/**
+ * \brief helper function to parse a value from text, leading blanks and a plus sign are skipped
+ */
+template <class T>
+bool GetText(std::string_view s, T &val)
+{
+   const char *p = s.data(), *end = p + s.size();
+   while(p < end && (*p == ' ' || *p == '\t')) p++;
+   if(p < end && *p == '+') p++;
+   std::from_chars_result r = std::from_chars(p, end, val);
+   return r.ec == std::errc();
+}
+
+bool GetText(std::string_view s, bool &val)
+{
+   int i;
+   if(!GetText(s, i) || (i != 0 && i != 1)) return false;
+   val = i;
+   return true;
+}
+
+/**
+ * \brief helper function to compare a written value with the one LabView echoes back
+ *
+ * Single precision values only have to agree as floats, doubles within a few units
+ * in the last place, in case LabView formats the echo with its own precision.
+ */
+bool SameValue(const double a, const double b, const int type)
+{
+   if(isnan(a) || isnan(b)) return isnan(a) && isnan(b);
+   if(type == TID_FLOAT) return float(a) == float(b);
+   return a == b || fabs(a - b) <= 4*DBL_EPSILON*std::max(fabs(a), fabs(b));
 }
 
+/**
+ * \brief helper function to convert an integer between LabView and ODB types
+ *
+ * Fails if the value does not fit, e.g. an I64 beyond the range of its I32 ODB entry.
+ */
+template <class T, class O>
+bool Narrow(const T val, O &out)
+{
+   out = O(val);
+   return T(out) == val && (out < O()) == (val < T());
+}
+
+/** \brief db_scan_tree() callback collecting handle and key of every value in a vector<pair<HNDLE,KEY> >. */
 int add_key(HNDLE hDB, HNDLE hkey, KEY *key, INT level, void *pvector){
    if(key->type != TID_KEY)
-      ((vector<KEY>*)pvector)->push_back(*key);
+      ((vector<std::pair<HNDLE,KEY> >*)pvector)->emplace_back(hkey, *key);
    return DB_SUCCESS;
 }
 
@@ -72,9 +253,27 @@ int add_key(HNDLE hDB, HNDLE hkey, KEY *key, INT level, void *pvector){
  * not automatically get removed from the ODB, just a warning message is issued.
  *
  * Some ODB settings are always present, not dependent on the configuration of the LabView server:
- * @param hostname IP or hostname of the LabView server
+ * @param hostname IP or hostname of the LabView server, \c unix:/path for a Unix domain socket or \c shm:name for shared memory on the same host (port is then ignored)
  * @param port port LabView is listening on
+ * @param readTimeoutMin lower limit in ms of the read timeout derived from measured round trip times, default 20
+ * @param readTimeoutMax upper limit in ms of the read timeout, also used until the first round trip is measured, default 2000
+ * @param keepAlive idle time in s before the kernel probes the connection to LabView, 0 to disable, default 10
+ * @param userTimeout time in ms the kernel waits for LabView to acknowledge sent data before dropping the connection, 0 for the system default, default 10000
+ * @param ioUring \c true to do socket I/O through io_uring if the kernel supports it (linux 6.0 or later), otherwise poll() is used
+ * @param heartbeat time in ms without any traffic from LabView after which it is pinged with the handshake, 0 to disable, default 5000
  * @param applyOnFestart \c true to overwrite LabView settings with ODB values, \c false (default) update ODB with current settings from LabView <b>NOT IMPLEMENTED YET</b>
+ * @param batchRead maximum number of variables requested in a single \c read: command, 0 (default) reads every variable with its own request
+ * @param pipelineDepth maximum number of single variable requests sent before waiting for replies, 1 (default) for strict request/reply
+ * @param cycleBudget time in ms a complete poll of LabView may take, values not read in time are reported as partial and left for the next cycle, 0 (default) for no limit
+ * @param connections number of connections to LabView polled in parallel, 1 (default) for a single connection (text protocol only)
+ * @param binaryProtocol \c true to ask LabView for the binary protocol during the handshake, falls back to text if LabView does not support it
+ * @param subscribe \c true to ask LabView to push changed values instead of polling all variables periodically (text protocol only)
+ *
+ * Which LabView values go to ODB is chosen in \c <Eqname>_odbselection.txt in the experiment
+ * directory, one \c name:s|v:y|n line per setting or variable. Noisy values can be filtered with
+ * up to three more columns, \c name:v:y:abs:rel:ms drops numeric changes up to \c abs or up to
+ * \c rel times the ODB value, and writes the key at most once per \c ms milliseconds. Use 0 for
+ * columns that do not apply.
  */
 class feLabview :
    public feTCP
@@ -102,18 +301,33 @@ public:
       // add ODB settings that are internal -> not for LabView
       fEq->fOdbEqSettings->RI("verbosity", &verbose, true);
 
-      sets.push_back("hostname");
-      stype.push_back(TID_STRING);
-      sets.push_back("port");
-      stype.push_back(TID_STRING);
-      sets.push_back("verbosity");
-      stype.push_back(TID_INT32);
-      sets.push_back("applyOnFestart");
-      stype.push_back(TID_BOOL);
+      channels.Add("hostname", set, FindType(TID_STRING));
+      channels.Add("port", set, FindType(TID_STRING));
+      channels.Add("readTimeoutMin", set, FindType(TID_INT32));
+      channels.Add("readTimeoutMax", set, FindType(TID_INT32));
+      channels.Add("keepAlive", set, FindType(TID_INT32));
+      channels.Add("userTimeout", set, FindType(TID_INT32));
+      channels.Add("ioUring", set, FindType(TID_BOOL));
+      channels.Add("heartbeat", set, FindType(TID_INT32));
+      fEq->fOdbEqSettings->RI("heartbeat", &heartbeat, true);
+      channels.Add("verbosity", set, FindType(TID_INT32));
+      channels.Add("applyOnFestart", set, FindType(TID_BOOL));
       fEq->fOdbEqSettings->RB("applyOnFestart", &apply_on_start, true);
-
-      fixedSets = sets;
-      fixedVars = vars;
+      channels.Add("batchRead", set, FindType(TID_INT32));
+      fEq->fOdbEqSettings->RI("batchRead", &batch_size, true);
+      channels.Add("pipelineDepth", set, FindType(TID_INT32));
+      fEq->fOdbEqSettings->RI("pipelineDepth", &pipeline_depth, true);
+      if(pipeline_depth < 1) pipeline_depth = 1;
+      channels.Add("cycleBudget", set, FindType(TID_INT32));
+      fEq->fOdbEqSettings->RI("cycleBudget", &cycle_budget, true);
+      channels.Add("connections", set, FindType(TID_INT32));
+      fEq->fOdbEqSettings->RI("connections", &pool_size, true);
+      channels.Add("binaryProtocol", set, FindType(TID_BOOL));
+      fEq->fOdbEqSettings->RB("binaryProtocol", &use_binary, true);
+      channels.Add("subscribe", set, FindType(TID_BOOL));
+      fEq->fOdbEqSettings->RB("subscribe", &use_subscribe, true);
+
+      nfixed = channels.size();
 
       string exppath = cm_get_path();
       odbsfilename = exppath + "/" + fEq->fName + "_odbselection.txt";
@@ -159,18 +373,24 @@ public:
    //    fEq->SetStatus("Stopped", "#00FF00");
    // }
 
-   /** \brief Periodic operations, reading variables from LabView. */
+   /** \brief Periodic operations, reading variables from LabView.
+    *
+    * After repeated failures the connection is considered lost, the main loop then
+    * calls Reconnect() until LabView is back.
+    */
    void HandlePeriodic()
    {
       // printf("periodic!\n");
-      int errors = read_event();
-      if(errors){
-         static int fails = 0;
+      if(!connected) return;
+      int errors = subscribed ? 0 : read_event();
+      if(errors || !TCPConnected()){
          fails++;
-         if(fails > 3){
-            fMfe->Msg(MERROR, "HandlePeriodic", "Persistent communication problems with LabView, terminating.");
-            connected = false;
+         if(fails > 3 || !TCPConnected()){
+            fMfe->Msg(MERROR, "HandlePeriodic", "Lost communication with LabView, reconnecting.");
+            ConnectionLost();
          }
+      } else {
+         fails = 0;
       }
       //char buf[256];
       //sprintf(buf, "buffered %d (max %d), dropped %d, unknown %d, max flushed %d", gUdpPacketBufSize, fMaxBuffered, fCountDroppedPackets, fCountUnknownPackets, fMaxFlushed);
@@ -178,7 +398,7 @@ public:
       //fEq->WriteStatistics();
    }
 
-   /** \brief Function called on ODB setting change, sending variables to LabView. */
+   /** \brief Function called on ODB change of a setting, sending it to LabView and refreshing its shadow value. */
    void fecallback(HNDLE hDB, HNDLE hkey, INT index);
    INT read_event();
 
@@ -190,79 +410,280 @@ public:
       return connected;
    }
 
+   /** \brief Switch protocol and open the connection pool, once the variable list is known. */
+   void StartSession()
+   {
+      SelectProtocol();
+      if(pool_size > 1 && !binary){
+         unsigned int n = OpenPool(pool_size, "midas\r\n", "labview");
+         if(verbose) fMfe->Msg(MINFO, "StartSession", "Polling over %u connections", n);
+      }
+   }
+
+   bool Reconnect();
+   void Heartbeat();
+
    /** \brief Request list of variables from LabView, populate ODB. */
    unsigned int GetVars();
    bool Connected(){return connected;}
+   bool Failed(){return failed;}
    bool SyncSettings();
+   bool Subscribe();
+   int ReadUpdates();
 private:
    /** \brief Confirm server we're talking to is actually LabView. */
    bool Handshake(){
-      string resp = Exchange("midas\r\n");
+      string resp = Exchange("midas\r\n", true, "labview");
       bool correct = (resp.substr(0,7) == string("labview"));
       if(!correct) fMfe->Msg(MERROR, "Handshake", "Unexpected response: %s", resp.c_str());
       else if(verbose) fMfe->Msg(MINFO, "Handshake", "Handshake successful");
+      binary = false;
       return correct;
    }
-   int TypeConvert(const string &s);
+   /** \brief Ask LabView for the binary protocol if enabled, has to follow list:vars. */
+   void SelectProtocol(){
+      binary = false;
+      if(use_binary){
+         string resp = Exchange("protocol" VALSEPARATOR "binary\r\n", true, "protocol");
+         binary = (resp == string("protocol" VALSEPARATOR BINVERSION));
+         if(binary) fMfe->Msg(MINFO, "SelectProtocol", "Using binary protocol");
+         else fMfe->Msg(MINFO, "SelectProtocol", "LabView does not support binary protocol, using text");
+      }
+   }
+   int TypeConvert(std::string_view s);
    string TypeConvert(const int t);
    enum varset { var, set };
+   struct Channel;
+
+   /** \brief Everything that depends on the type of a LabView variable, one row of lvtypes[] per type.
+    *
+    * GetVars() resolves the row of every variable once, reading and writing values then
+    * goes through its function pointers instead of switching on the type per value.
+    */
+   struct LVType
+   {
+      int tid;                  ///< MIDAS type as LabView reports it, also sent with binary values
+      const char *lvname;       ///< LabView type name in the list:vars reply
+      int odbtid;               ///< type of the ODB key, ODB has no 8 and 64 bit integers
+      bool (feLabview::*text)(Channel &c, const std::string_view *reply); ///< text reply to ODB, without reply it is requested first
+      bool (feLabview::*bin)(Channel &c, const char *&p, const char *end); ///< binary value record to ODB
+      bool (feLabview::*write)(Channel &c); ///< ODB setting to LabView
+      void (feLabview::*cache)(Channel &c); ///< reload the shadow value from ODB
+
+      /** \brief Row for values LabView sends as \c T and ODB stores as \c O. */
+      template <class T, class O>
+      static constexpr LVType Make(const int tid, const char *lvname, const int odbtid)
+      {
+         return LVType{tid, lvname, odbtid, &feLabview::TextToODB<T,O>, &feLabview::BinValToODB<T,O>, &feLabview::ODBtoLV<T,O>, &feLabview::CacheODB<O>};
+      }
+   };
+   static const LVType lvtypes[];
+   static const LVType *FindType(const int tid);
+
+   /** \brief Interned channel names.
+    *
+    * Every name is stored once and never moved, so the views handed out stay valid for
+    * the lifetime of the table and can be compared, hashed and kept without copying.
+    * They are NUL-terminated, data() can be passed to C APIs.
+    */
+   class Symbols
+   {
+   public:
+      std::string_view Intern(std::string_view s);
+   private:
+      std::deque<string> strings;
+      std::unordered_set<std::string_view> index;
+   };
 
-   template <class T>
-   bool ReadLVVar(const varset vs, const string name, const int type, T &retval);
-   bool ReadLVVar(const varset vs, const string name, const int type, string &retval);
+   /** \brief Value of an ODB key, in one of the types ODB stores LabView values as. */
+   typedef std::variant<std::monostate, bool, int32_t, uint16_t, uint32_t, float, double, string> ODBValue;
 
-   bool LVtoODB(const varset vs, const string name, const int type);
+   /** \brief Filter for noisy values, optional columns of the select file, see ReadSelectFile(). */
+   struct Deadband
+   {
+      double abs = 0;           ///< numeric changes up to this size are not written to ODB
+      double rel = 0;           ///< numeric changes up to this fraction of the ODB value are not written
+      double interval = 0;      ///< minimum time in s between two ODB writes of the channel
+   };
 
-   bool WriteLVSetFromODB(const HNDLE hkey);
-   bool WriteLVSetFromODB(const KEY key);
+   /** \brief One LabView setting or variable, or a setting of the frontend itself. */
+   struct Channel
+   {
+      std::string_view name;    ///< interned, see Symbols
+      varset vs;
+      const LVType *type;
+      int lvid;                 ///< position in the list:vars reply, ID for the binary protocol, -1 for frontend settings
+      HNDLE hkey = 0;           ///< ODB key, found or created by GetVars()
+      bool selected = false;    ///< enabled in the select file, read from LabView
+      string request;           ///< "name:?" request reading the value
+      /** \brief "name:", the beginning of every reply with the value, a view into \c request. */
+      std::string_view Prefix() const { return std::string_view(request).substr(0, name.size() + 1); }
+      ODBValue last;            ///< shadow of the ODB value, empty until loaded, see CacheODB()
+      bool changed = false;     ///< \c last differs from ODB until the next CommitODB()
+      bool unsent = false;      ///< setting changed in ODB while disconnected, sent by Reconnect()
+      Deadband band;
+      double next_write = 0;    ///< earliest time of the next ODB write, see Deadband::interval
+   };
+
+   /** \brief Registry of all channels with stable integer IDs.
+    *
+    * Channels live in one contiguous array, an ID is the position in it and stays valid
+    * until Truncate() drops the channel. A hash index per ODB directory maps names to IDs.
+    */
+   class Channels
+   {
+   public:
+      unsigned int Add(std::string_view name, const varset vs, const LVType *type, const int lvid = -1);
+      int Find(const varset vs, std::string_view name) const; ///< -1 if unknown
+      void SetKey(const unsigned int id, const HNDLE hkey);
+      int FindKey(const HNDLE hkey) const; ///< -1 if no channel has this ODB key
+      void Truncate(const unsigned int n);
+      unsigned int size() const { return entries.size(); }
+      Channel &operator[](const unsigned int id){ return entries[id]; }
+      unsigned int Id(const Channel &c) const { return &c - entries.data(); }
+      const Channel &operator[](const unsigned int id) const { return entries[id]; }
+   private:
+      Symbols symbols;
+      vector<Channel> entries;
+      std::unordered_map<std::string_view,unsigned int> index[2]; ///< name to ID, variables and settings
+      std::unordered_map<HNDLE,unsigned int> keys; ///< ODB key to ID
+   };
+
+   template <class T>
+   bool ReadLVVar(const Channel &c, T &retval);
    template <class T>
-   bool WriteLVSet(const string name, const int type, const T val);
-   bool WriteLVSet(const string name, const int type, const double val);
-   bool WriteLVSet(const string name, const int type, const float val){
-      return WriteLVSet(name, type, (double)val);
+   bool ParseLVVar(std::string_view resp, std::string_view name, T &retval);
+   bool ParseLVVar(std::string_view resp, std::string_view name, string &retval);
+
+   template <class T, class O>
+   bool TextToODB(Channel &c, const std::string_view *reply);
+   template <class T, class O>
+   bool BinValToODB(Channel &c, const char *&p, const char *end);
+   template <class T, class O>
+   bool StoreODB(Channel &c, const T &val);
+   template <class T, class O>
+   bool ODBtoLV(Channel &c);
+   template <class O>
+   void CacheODB(Channel &c);
+
+   /** \brief Copy one LabView value to the ODB, from \p reply or read with its own request. */
+   bool LVtoODB(const unsigned int id, const std::string_view *reply = NULL){
+      Channel &c = channels[id];
+      return (this->*c.type->text)(c, reply);
    }
+   int LVtoODB(const vector<unsigned int> &ids);
    template <class T>
-   void WriteODB(const varset vs, const string name, const int type, const T val);
-   void WriteODB(const varset vs, const string name, const int type, const int64_t val);
-   void WriteODB(const varset vs, const string name, const int type, const uint64_t val);
-   void WriteODB(const varset vs, const string name, const int type, const string val);
+   void ValToODB(Channel &c, const T &val);
+
+   template <class T>
+   void EncodeLVVal(string &buf, const int type, const T val);
+   void EncodeLVVal(string &buf, const int type, const string val);
+   template <class T>
+   bool DecodeLVVal(const char *&p, const char *end, const int type, T &retval);
+   bool DecodeLVVal(const char *&p, const char *end, const int type, string &retval);
+   /** \brief Decode one binary value record and write it to ODB, advancing \p p past the record. */
+   bool BinToODB(const unsigned int id, const char *&p, const char *end){
+      Channel &c = channels[id];
+      return (this->*c.type->bin)(c, p, end);
+   }
+   int BinToODB(const vector<unsigned int> &ids);
    template <class T>
-   void ReadODB(const varset vs, const string name, const int type, T &retval);
-   void ReadODB(const varset vs, const string name, const int type, string &retval);
+   bool WriteLVSetBin(const Channel &c, const T val);
 
+   bool WriteLVSetFromODB(const KEY key);
    template <class T>
-   inline void ReadODBVal(MVOdb *db, const string name, T &val){
-      cm_msg(MERROR, "ReadODBVar", "Requested unknown ODB type");
+   bool WriteLVSet(const Channel &c, const T val);
+
+   void ReadODBVal(MVOdb *db, const char *name, bool &val){
+      db->RB(name, &val);
+   };
+   void ReadODBVal(MVOdb *db, const char *name, int32_t &val){
+      db->RI(name, &val);
+   };
+   void ReadODBVal(MVOdb *db, const char *name, float &val){
+      db->RF(name, &val);
+   };
+   void ReadODBVal(MVOdb *db, const char *name, double &val){
+      db->RD(name, &val);
+   };
+   void ReadODBVal(MVOdb *db, const char *name, uint16_t &val){
+      db->RU16(name, &val);
+   };
+   void ReadODBVal(MVOdb *db, const char *name, uint32_t &val){
+      db->RU32(name, &val);
+   };
+   void ReadODBVal(MVOdb *db, const char *name, string &val){
+      db->RS(name, &val);
+   };
+
+   int SetODBData(const HNDLE hkey, const bool val){
+      BOOL b = val;
+      return db_set_data(fMfe->fDB, hkey, &b, sizeof(b), 1, TID_BOOL);
+   };
+   int SetODBData(const HNDLE hkey, const int32_t val){
+      return db_set_data(fMfe->fDB, hkey, &val, sizeof(val), 1, TID_INT32);
+   };
+   int SetODBData(const HNDLE hkey, const float val){
+      return db_set_data(fMfe->fDB, hkey, &val, sizeof(val), 1, TID_FLOAT);
+   };
+   int SetODBData(const HNDLE hkey, const double val){
+      return db_set_data(fMfe->fDB, hkey, &val, sizeof(val), 1, TID_DOUBLE);
+   };
+   int SetODBData(const HNDLE hkey, const uint16_t val){
+      return db_set_data(fMfe->fDB, hkey, &val, sizeof(val), 1, TID_UINT16);
+   };
+   int SetODBData(const HNDLE hkey, const uint32_t val){
+      return db_set_data(fMfe->fDB, hkey, &val, sizeof(val), 1, TID_UINT32);
+   };
+   int SetODBData(const HNDLE hkey, const string &val){
+      return db_set_data(fMfe->fDB, hkey, val.c_str(), val.size()+1, 1, TID_STRING);
    };
-   void ReadODBVal(MVOdb *db, const string name, bool &val){
-      db->RB(name.c_str(), &val);
-   };   
-   void ReadODBVal(MVOdb *db, const string name, int32_t &val){
-      db->RI(name.c_str(), &val);
-   };   
-   void ReadODBVal(MVOdb *db, const string name, float &val){
-      db->RF(name.c_str(), &val);
-   };   
-   void ReadODBVal(MVOdb *db, const string name, double &val){
-      db->RD(name.c_str(), &val);
-   };   
-   void ReadODBVal(MVOdb *db, const string name, uint16_t &val){
-      db->RU16(name.c_str(), &val);
-   };   
-   void ReadODBVal(MVOdb *db, const string name, uint32_t &val){
-      db->RU32(name.c_str(), &val);
-   };   
+   int CommitODB();
 
    bool ReadSelectFile();
-   vector<string> vars, sets, fixedSets, fixedVars;
-   vector<int> vtype, stype;
+   Channels channels;
+   unsigned int nfixed = 0;     ///< frontend settings at the start of channels, not from LabView
+   vector<unsigned int> sets, vars; ///< IDs of the selected LabView settings and variables
+   vector<unsigned int> changed; ///< IDs of channels whose shadow value still has to go to ODB, see CommitODB()
+   // buffers reused from poll to poll, so reading values does not allocate
+   string reply_buf;            ///< reply to a single read
+   vector<string> batch_requests, replies;
+   vector<std::string_view> requests, expected;
    int verbose = 1;
    bool connected = false;
-   std::map<string,bool> varselect, setselect;
+   std::map<string,bool,std::less<> > varselect, setselect;
+   std::map<string,Deadband,std::less<> > vardeadband, setdeadband;
    string odbsfilename;
    bool apply_on_start;
+   int batch_size = 0;
+   bool batch_works = false;    ///< LabView answered a read: request, later empty replies are timeouts
+   int pipeline_depth = 1;
+   int pool_size = 1;
+   int cycle_budget = 0;        ///< ms per read_event(), 0 for no limit
+   int heartbeat = 5000;        ///< ms without traffic before LabView is pinged, 0 to disable
+   bool use_binary = false;     ///< request binary protocol during handshake
+   bool binary = false;         ///< binary protocol negotiated
+   bool use_subscribe = false;  ///< request server-push updates after GetVars()
+   bool subscribed = false;     ///< LabView pushes changed values, periodic polling is off
+   /** \brief Mark connection as lost, the main loop then calls Reconnect(). */
+   void ConnectionLost()
+   {
+      fEq->SetStatus("Reconnecting...", "yellow");
+      connected = false;
+      subscribed = false;
+      fAcceptPushed = false;
+      reconnect_delay = 0;
+      next_reconnect = 0;
+   }
+
    bool select_exists;
    vector<KEY> odbsetkeys;
+   string schema;               ///< list:vars reply of the first connection, compared on reconnect
+   int fails = 0;               ///< consecutive periodic reads with errors
+   bool failed = false;         ///< unrecoverable error, frontend should exit
+   double reconnect_delay = 0;  ///< current reconnect backoff in seconds
+   double next_reconnect = 0;   ///< time of next reconnect attempt
+   static constexpr double reconnect_min = 0.1, reconnect_max = 30.;
 };
 
 /** \brief global wrapper for Midas callback of class function
@@ -274,619 +695,583 @@ void callback(INT hDB, INT hkey, INT index, void *feptr)
    fe->fecallback(hDB, hkey, index);
 }
 
-int feLabview::TypeConvert(const string &stype)
+/** \brief Supported LabView types, one row per type.
+ *
+ * LabView sends values as the first type, ODB stores them as the second.
+ */
+const feLabview::LVType feLabview::lvtypes[] = {
+   LVType::Make<bool,     bool    >(TID_BOOL,   "Boolean",      TID_BOOL),
+   LVType::Make<int8_t,   int32_t >(TID_INT8,   "I8",           TID_INT32),
+   LVType::Make<int16_t,  int32_t >(TID_INT16,  "I16",          TID_INT32),
+   LVType::Make<int32_t,  int32_t >(TID_INT32,  "I32",          TID_INT32),
+   LVType::Make<int64_t,  int32_t >(TID_INT64,  "I64",          TID_INT32),
+   LVType::Make<uint8_t,  uint16_t>(TID_UINT8,  "U8",           TID_UINT16),
+   LVType::Make<uint16_t, uint16_t>(TID_UINT16, "U16",          TID_UINT16),
+   LVType::Make<uint32_t, uint32_t>(TID_UINT32, "U32",          TID_UINT32),
+   LVType::Make<uint64_t, uint32_t>(TID_UINT64, "U64",          TID_UINT32),
+   LVType::Make<float,    float   >(TID_FLOAT,  "Single Float", TID_FLOAT),
+   LVType::Make<double,   double  >(TID_DOUBLE, "Double Float", TID_DOUBLE),
+   LVType::Make<string,   string  >(TID_STRING, "String",       TID_STRING),
+};
+
+const feLabview::LVType *feLabview::FindType(const int tid)
 {
-   if(stype == string("Boolean")) return TID_BOOL;
-   else if(stype == string("I8")) return TID_INT8;
-   else if(stype == string("I16")) return TID_INT16;
-   else if(stype == string("I32")) return TID_INT32;
-   else if(stype == string("I64")) return TID_INT64;
-   else if(stype.find("U8") != string::npos) return TID_UINT8;
-   else if(stype.find("U16") != string::npos) return TID_UINT16;
-   else if(stype.find("U32") != string::npos) return TID_UINT32;
-   else if(stype == string("U64")) return TID_UINT64;
-   else if(stype == string("Single Float")) return TID_FLOAT;
-   else if(stype == string("Double Float")) return TID_DOUBLE;
-   else if(stype == string("Extended Float")) return 0;
-   else if(stype == string("String")) return TID_STRING;
-   else {
-      fMfe->Msg(MERROR, "TypeConvert", "Unsupported data type: %s",  stype.c_str());
-      return 0;
+   for(const LVType &t: lvtypes)
+      if(t.tid == tid) return &t;
+   return NULL;
+}
+
+std::string_view feLabview::Symbols::Intern(std::string_view s)
+{
+   auto it = index.find(s);
+   if(it != index.end()) return *it;
+   strings.emplace_back(s);
+   return *index.insert(strings.back()).first;
+}
+
+/** \brief Register a channel, returns its ID. A name already known in \p vs keeps its ID and gets the new type. */
+unsigned int feLabview::Channels::Add(std::string_view name, const varset vs, const LVType *type, const int lvid)
+{
+   name = symbols.Intern(name);
+   auto res = index[vs].emplace(name, entries.size());
+   if(res.second){
+      entries.push_back(Channel{name, vs, type, lvid});
+      Channel &c = entries.back();
+      c.request.reserve(name.size() + 4);
+      c.request.append(name).append(VALSEPARATOR "?\r\n");
+   } else {
+      Channel &c = entries[res.first->second];
+      c.type = type;
+      c.lvid = lvid;
    }
+   return res.first->second;
 }
 
-string feLabview::TypeConvert(const int type)
+int feLabview::Channels::Find(const varset vs, std::string_view name) const
+{
+   auto it = index[vs].find(name);
+   return (it == index[vs].end()) ? -1 : int(it->second);
+}
+
+void feLabview::Channels::SetKey(const unsigned int id, const HNDLE hkey)
 {
-   switch(type){
-   case TID_BOOL:   return "Boolean"; break;
-   case TID_INT8:   return "I8"; break;
-   case TID_INT16:   return "I16"; break;
-   case TID_INT32:   return "I32"; break;
-   case TID_INT64:   return "I64"; break;
-   case TID_UINT8:   return "U8"; break;
-   case TID_UINT16:   return "U16"; break;
-   case TID_UINT32:   return "U32"; break;
-   case TID_UINT64:   return "U64"; break;
-   case TID_FLOAT:  return "Single Float"; break;
-   case TID_DOUBLE: return "Double Float"; break;
-   case TID_STRING: return "String"; break;
-   default: return "Unknown";         // this shouldn't occur
+   entries[id].hkey = hkey;
+   if(hkey) keys[hkey] = id;
+}
+
+int feLabview::Channels::FindKey(const HNDLE hkey) const
+{
+   auto it = keys.find(hkey);
+   return (it == keys.end()) ? -1 : int(it->second);
+}
+
+/** \brief Drop all channels from ID \p n on, the IDs below stay valid. */
+void feLabview::Channels::Truncate(const unsigned int n)
+{
+   for(unsigned int id = n; id < entries.size(); id++){
+      index[entries[id].vs].erase(entries[id].name);
+      if(entries[id].hkey) keys.erase(entries[id].hkey);
    }
+   if(n < entries.size())
+      entries.erase(entries.begin() + n, entries.end());
+}
+
+int feLabview::TypeConvert(std::string_view stype)
+{
+   for(const LVType &t: lvtypes)
+      if(stype == t.lvname) return t.tid;
+   // unsigned integers are also recognised inside longer type names
+   for(const LVType &t: lvtypes)
+      if(t.lvname[0] == 'U' && stype.find(t.lvname) != string::npos) return t.tid;
+   if(stype != "Extended Float")
+      fMfe->Msg(MERROR, "TypeConvert", "Unsupported data type: %.*s", int(stype.size()), stype.data());
+   return 0;
+}
+
+string feLabview::TypeConvert(const int type)
+{
+   const LVType *t = FindType(type);
+   return t ? t->lvname : "Unknown"; // this shouldn't occur
 }
 
 template <class T>
-bool feLabview::ReadLVVar(const varset vs, const string name, const int type, T &retval)
+bool feLabview::ReadLVVar(const Channel &c, T &retval)
 {
-   std::ostringstream oss;
-   // if(vs == var) oss << 'R';
-   // else if(vs == set) oss << 'W';
-   // oss << TypeConvert(type);
-   oss << name;
-   string varname = oss.str();
-   oss << VALSEPARATOR << "?\r\n";
-   string resp=Exchange(oss.str(), true, varname);
-   if(verbose>2) cout << "ReadLVVar Sent: " << oss.str() << "\tReceived: " << resp << endl;
-   vector<string> rv = split(resp, VALSEPARATOR);
-   bool success = false;
-   if(rv.size()==2){
-      if(rv[0] != varname){
-         cm_msg(MERROR, "ReadLVVar", "Asked for %s, but got %s", name.c_str(), rv[0].c_str());
-         return false;
-      }
-      std::istringstream iss(rv[1]);
-      switch(type){
-      case TID_UINT64:{
-         uint64_t u64;
-         if(iss >> u64) success = true;
-         if(success){
-            success = u64 < std::numeric_limits<uint32_t>::max();
-            if(success){
-               retval = u64;
-            } else {
-               cm_msg(MERROR, "ReadLVVar", "U64 integer too large to fit in U32 ODB entry");
-            }
-         }
-         break;
-      }
-      case TID_INT64:{
-         int64_t i64;
-         if(iss >> i64) success = true;
-         if(success){
-            success = abs(i64) < std::numeric_limits<int32_t>::max();
-            if(success){
-               retval = i64;
-            } else {
-               cm_msg(MERROR, "ReadLVVar", "I64 integer too large to fit in I32 ODB entry");
-            }
-         }
-         break;
-      }
-      default:
-         if(iss >> retval) success = true;    // this acts like a boolean, so if the operation fails, returns false
-      }
+   Exchange(c.request, reply_buf, true, c.Prefix());
+   if(verbose>2) cout << "ReadLVVar Sent: " << c.request << "\tReceived: " << reply_buf << endl;
+   return ParseLVVar(reply_buf, c.name, retval);
+}
+
+/** \brief Decode a single "name:value" reply from LabView. */
+template <class T>
+bool feLabview::ParseLVVar(std::string_view resp, std::string_view name, T &retval)
+{
+   std::string_view rv[2];
+   if(Tokenizer(resp, VARSEPARATOR[0], VALSEPARATOR[0]).Next(rv, 2) != 2)
+      return false;
+   if(rv[0] != name){
+      cm_msg(MERROR, "ReadLVVar", "Asked for %.*s, but got %.*s", int(name.size()), name.data(), int(rv[0].size()), rv[0].data());
+      return false;
    }
-   return success;
+   return GetText(rv[1], retval);
 }
 
-bool feLabview::ReadLVVar(const varset vs, const string name, const int type, string &retval)
+bool feLabview::ParseLVVar(std::string_view resp, std::string_view name, string &retval)
 {
-   std::ostringstream oss;
-   // if(vs == var) oss << 'R';
-   // else if(vs == set) oss << 'W';
-   // oss << TypeConvert(type);
-   oss << name;
-   string varname = oss.str();
-   oss << VALSEPARATOR << "?\r\n";
-   string resp=Exchange(oss.str(), true, varname);
-   if(verbose>2) cout << "ReadLVVar Sent: " << oss.str() << "\tReceived: " << resp << endl;
-   vector<string> rv;
+   // the value itself may contain separators
    size_t sep = resp.find_first_of(VALSEPARATOR);
-   if(sep != string::npos){
-      rv.push_back(resp.substr(0, sep));
-      rv.push_back(resp.substr(sep+1));
-   }
    bool success = false;
-   if(rv.size()==2){
-      if(rv[0] != varname){
-         cm_msg(MERROR, "ReadLVVar", "Asked for %s, but got %s", name.c_str(), rv[0].c_str());
+   if(sep != string::npos){
+      std::string_view rname = resp.substr(0, sep);
+      if(rname != name){
+         cm_msg(MERROR, "ReadLVVar", "Asked for %.*s, but got %.*s", int(name.size()), name.data(), int(rname.size()), rname.data());
          return false;
       }
-      assert(type == TID_STRING);
-      retval = rv[1];
+      retval = resp.substr(sep+1);
       success = true;
    }
    return success;
 }
 
-bool feLabview::WriteLVSetFromODB(const HNDLE hkey)
+template <class T, class O>
+bool feLabview::TextToODB(Channel &c, const std::string_view *reply)
 {
-   KEY key;
-   int status = db_get_key(fMfe->fDB, hkey, &key);
-   if(status == DB_SUCCESS)
-      return WriteLVSetFromODB(key);
-   else
-      return false;
+   T val;
+   bool success;
+   if(reply) success = ParseLVVar(*reply, c.name, val);
+   else success = ReadLVVar(c, val);
+   return success && StoreODB<T,O>(c, val);
 }
 
-bool feLabview::WriteLVSetFromODB(const KEY key)
+template <class T, class O>
+bool feLabview::BinValToODB(Channel &c, const char *&p, const char *end)
 {
-   MVOdb *db = fEq->fOdbEqSettings;
-   bool success = false;
+   T val;
+   return DecodeLVVal(p, end, c.type->tid, val) && StoreODB<T,O>(c, val);
+}
 
-   if(verbose > 1){
-      std::cout << "Setting ODB entry " << key.name << std::endl;
-   }
-   switch(key.type){
-   case TID_BOOL:{
-      bool val;
-      db->RB(key.name, &val);
-      success = WriteLVSet(key.name, key.type, val);
-      break;
-   }
-   case TID_INT32:{
-      int val;
-      db->RI(key.name, &val);
-      success = WriteLVSet(key.name, key.type, val);
-      break;
-   }
-   case TID_FLOAT:{
-      float val;
-      db->RF(key.name, &val);
-      success = WriteLVSet(key.name, key.type, val);
-      break;
-   }
-   case TID_DOUBLE:{
-      double val;
-      db->RD(key.name, &val);
-      success = WriteLVSet(key.name, key.type, val);
-      break;
-   }
-   case TID_STRING:{
-      string val;
-      db->RS(key.name, &val);
-      success = WriteLVSet(key.name, key.type, val);
-      break;
-   }
-   case TID_UINT16:{
-      uint16_t val;
-      db->RU16(key.name, &val);
-      success = WriteLVSet(key.name, key.type, val);
-      break;
-   }
-   case TID_UINT32:{
-      uint32_t val;
-      db->RU32(key.name, &val);
-      success = WriteLVSet(key.name, key.type, val);
-      break;
+/** \brief Write a LabView value to its ODB entry, narrowed to the ODB type. */
+template <class T, class O>
+bool feLabview::StoreODB(Channel &c, const T &val)
+{
+   if constexpr (std::is_same_v<T,O>){
+      ValToODB(c, val);
+   } else {
+      O odbval;
+      if(!Narrow(val, odbval)){
+         cm_msg(MERROR, "LVtoODB", "%s value of %s does not fit in its ODB entry", c.type->lvname, c.name.data());
+         return false;
+      }
+      ValToODB(c, odbval);
    }
+   return true;
+}
+
+/** \brief Load the shadow value of \p c from ODB. */
+template <class O>
+void feLabview::CacheODB(Channel &c)
+{
+   MVOdb *db = fEq->fOdbEqVariables;
+   if(c.vs == set) db = fEq->fOdbEqSettings;
+   O odbval;
+   ReadODBVal(db, c.name.data(), odbval);
+   c.last = std::move(odbval);
+}
+
+/** \brief Send an ODB setting to LabView, converted to the LabView type. */
+template <class T, class O>
+bool feLabview::ODBtoLV(Channel &c)
+{
+   CacheODB<O>(c);
+   const O &odbval = std::get<O>(c.last);
+   if constexpr (std::is_same_v<T,O>){
+      return WriteLVSet(c, odbval);
+   } else {
+      T val;
+      if(!Narrow(odbval, val)){
+         cm_msg(MERROR, "WriteLVSet", "ODB value of %s does not fit in LabView type %s", c.name.data(), c.type->lvname);
+         return false;
+      }
+      return WriteLVSet(c, val);
    }
-   return success;
 }
 
-template <class T>
-bool feLabview::WriteLVSet(const string name, const int type, const T val)
+bool feLabview::WriteLVSetFromODB(const KEY key)
 {
-   std::ostringstream oss;
-   // oss << 'W';
-   // oss << TypeConvert(type);
-   oss << name << VALSEPARATOR;
-   oss << val;
-   string orig = oss.str();
-   oss << "\r\n";
    if(verbose > 1){
-      cout << "Sending: " << oss.str() << endl;
+      std::cout << "Setting ODB entry " << key.name << std::endl;
    }
-   string resp = Exchange(oss.str());
-   if(resp == orig)
-      return true;
-   else {
-      cm_msg(MERROR, "WriteLVSet", "LabView comm. error: %s != %s", resp.c_str(), oss.str().substr(0, oss.str().find_last_not_of("\r\n")+1).c_str());
+   int id = channels.Find(set, key.name);
+   if(id < 0 || !channels[id].selected){
+      cm_msg(MERROR, "WriteLVSet", "%s is not a LabView setting", key.name);
       return false;
    }
+   Channel &c = channels[id];
+   return (this->*c.type->write)(c);
 }
 
-bool feLabview::WriteLVSet(const string name, const int type, const double val)
+template <class T>
+bool feLabview::WriteLVSet(const Channel &c, const T val)
 {
-   std::ostringstream oss;
-   // oss << 'W';
-   // oss << TypeConvert(type);
-   oss << name << VALSEPARATOR;
-
-   // FIXME: hack because currently Labview doesn't know how to read scientific notation
-   oss << std::fixed << std::setprecision(16);
-
-   oss << val;
-   string orig = oss.str();
-   oss << "\r\n";
+   if(binary) return WriteLVSetBin(c, val);
+   string msg(c.name);
+   msg += VALSEPARATOR;
+   size_t prefix = msg.size();
+   PutText(msg, val);
+   size_t len = msg.size();
+   msg += "\r\n";
    if(verbose > 1){
-      cout << "Sending: " << oss.str() << endl;
+      cout << "Sending: " << msg << endl;
    }
-   string resp = Exchange(oss.str());
+   string resp = Exchange(msg, true, std::string_view(msg).substr(0, prefix));
 
-   double retval = atof(resp.substr(resp.find_first_of(VALSEPARATOR)+1).c_str());
+   if constexpr (std::is_floating_point_v<T>){
+      double retval = 0;
+      size_t sep = resp.find_first_of(VALSEPARATOR);
+      bool ok = (sep != string::npos) && GetText(std::string_view(resp).substr(sep+1), retval);
 
-   if(retval == val)
-      return true;
-   else {
-      cm_msg(MERROR, "WriteLVSet", "LabView comm. error: %f != %f", retval, val);
+      if(ok && SameValue(retval, val, c.type->tid))
+         return true;
+      cm_msg(MERROR, "WriteLVSet", "LabView comm. error: %s != %.17g", resp.c_str(), double(val));
+      return false;
+   } else {
+      if(resp.compare(0, string::npos, msg, 0, len) == 0)
+         return true;
+      cm_msg(MERROR, "WriteLVSet", "LabView comm. error: %s != %s", resp.c_str(), msg.substr(0, len).c_str());
       return false;
    }
 }
 
 template <class T>
-void feLabview::WriteODB(const varset vs, const string name, const int type, const T val)
+void feLabview::EncodeLVVal(string &buf, const int type, const T val)
 {
-   MVOdb *db = fEq->fOdbEqVariables;
-   MVOdbError err;
-   if(vs == set) db = fEq->fOdbEqSettings;
-
-   assert(type != TID_STRING);
-   if(verbose > 2){
-      cout << "Writing to ODB: " << name << "\tvalue: " << val << endl;
-   }
-   switch(type){
-   case TID_BOOL:   db->WB(name.c_str(), val, &err); break;
-   case TID_INT8:
-   case TID_INT16:
-   case TID_INT32:    db->WI(name.c_str(), val, &err); break;
-   case TID_FLOAT:  db->WF(name.c_str(), val, &err); break;
-   case TID_DOUBLE: db->WD(name.c_str(), val, &err); break;
-   case TID_UINT16:   db->WU16(name.c_str(), val, &err); break;
-   case TID_UINT32:  db->WU32(name.c_str(), val, &err); break;
-   default: assert(0);          // Die if unsupported type is requested
-   }
-   if(err.fError){
-      cerr << "ERROR!!! " << err.fErrorString << "Status: " << err.fStatus << endl;
-   }
+   buf += char(type);
+   if constexpr (std::is_same_v<T,bool>) PutBE(buf, uint8_t(val ? 1 : 0));
+   else PutBE(buf, val);
 }
 
-void feLabview::WriteODB(const varset vs, const string name, const int type, const int64_t val)
+void feLabview::EncodeLVVal(string &buf, const int type, const string val)
 {
-   assert(type == TID_INT64);
-   if(abs(val) <= std::numeric_limits<int32_t>::max()){
-      int32_t i32 = val;
-      WriteODB(vs, name, type, i32);
-   } else {
-      cm_msg(MERROR, "WriteODB", "I64 integer too large to fit in I32 ODB entry");
-   }
+   assert(type == TID_STRING);
+   buf += char(type);
+   PutBE(buf, uint16_t(val.size()));
+   buf += val;
 }
 
-void feLabview::WriteODB(const varset vs, const string name, const int type, const uint64_t val)
+template <class T>
+bool feLabview::DecodeLVVal(const char *&p, const char *end, const int type, T &retval)
 {
-   assert(type == TID_UINT64);
-   if(val <= std::numeric_limits<uint32_t>::max()){
-      uint32_t u32 = val;
-      WriteODB(vs, name, type, u32);
+   if(p >= end || *p++ != char(type)){
+      cm_msg(MERROR, "DecodeLVVal", "Type mismatch, expected %s", TypeConvert(type).c_str());
+      return false;
+   }
+   if constexpr (std::is_same_v<T,bool>){
+      uint8_t v;
+      if(!GetBE(p, end, v)) return false;
+      retval = (v != 0);
+      return true;
    } else {
-      cm_msg(MERROR, "WriteODB", "U64 integer too large to fit in U32 ODB entry");
+      return GetBE(p, end, retval);
    }
 }
 
-void feLabview::WriteODB(const varset vs, const string name, const int type, const string val)
+bool feLabview::DecodeLVVal(const char *&p, const char *end, const int type, string &retval)
 {
-   MVOdb *db = fEq->fOdbEqVariables;
-   if(vs == set) db = fEq->fOdbEqSettings;
    assert(type == TID_STRING);
-   if(verbose > 2){
-      cout << "Writing string to ODB: " << name << "\tvalue: " << val << endl;
+   uint16_t len;
+   if(p >= end || *p++ != char(type) || !GetBE(p, end, len) || end - p < len){
+      cm_msg(MERROR, "DecodeLVVal", "Malformed string value");
+      return false;
    }
-   db->WS(name.c_str(), val.c_str(), val.size()+1);
+   retval.assign(p, len);
+   p += len;
+   return true;
 }
 
+/** \brief Send setting as \c BINWRITE frame, LabView echoes the new value as \c BINVALUE. */
 template <class T>
-void feLabview::ReadODB(const varset vs, const string name, const int type, T &val)
+bool feLabview::WriteLVSetBin(const Channel &c, const T val)
 {
-   MVOdb *db = fEq->fOdbEqVariables;
-   if(vs == set) db = fEq->fOdbEqSettings;
-   assert(type != TID_STRING);
-   switch(type){
-   case TID_INT8:
-   case TID_INT16:
-   case TID_INT64: int32_t i32; ReadODBVal(db, name, i32); val = i32; break;
-   case TID_UINT8:
-   case TID_UINT64: uint32_t u32; ReadODBVal(db, name, u32); val = u32; break;
-   case TID_BOOL:
-   case TID_INT32:
-   case TID_FLOAT:
-   case TID_DOUBLE:
-   case TID_UINT16:
-   case TID_UINT32:
-   default: ReadODBVal(db, name, val);
+   uint16_t id = c.lvid;
+   string frame(1, BINWRITE);
+   PutBE(frame, id);
+   EncodeLVVal(frame, c.type->tid, val);
+   string resp;
+   if(!WriteFrame(frame) || !ReadFrame(resp))
+      return false;
+   const char *p = resp.data(), *end = resp.data() + resp.size();
+   uint16_t count = 0, rid = 0;
+   T retval;
+   if(resp.size() < 3 || *p++ != BINVALUE || !GetBE(p, end, count) || count != 1 ||
+      !GetBE(p, end, rid) || rid != id || !DecodeLVVal(p, end, c.type->tid, retval)){
+      cm_msg(MERROR, "WriteLVSet", "LabView comm. error: malformed reply for %s", c.name.data());
+      return false;
    }
-}
-
-void feLabview::ReadODB(const varset vs, const string name, const int type, string &val)
-{
-   MVOdb *db = fEq->fOdbEqVariables;
-   if(vs == set) db = fEq->fOdbEqSettings;
-   assert(type == TID_STRING);
-   db->RS(name.c_str(), &val);
+   if(retval == val)
+      return true;
+   cm_msg(MERROR, "WriteLVSet", "LabView comm. error: %s not accepted", c.name.data());
+   return false;
 }
 
 unsigned int feLabview::GetVars()
 {
-   sets.resize(fixedSets.size()); vars.resize(fixedVars.size());
-   stype.resize(fixedSets.size()); vtype.resize(fixedVars.size());
-   string resp = Exchange("list:vars\r\n");
+   channels.Truncate(nfixed);
+   sets.clear(); vars.clear();
+   string resp = Exchange("list:vars\r\n", true, "", 0); // no length limit, one line with every variable
    if(verbose > 1) cout << "Response: " << resp << "(" << resp.size() << ")" << endl;
-   vector<string> tokens = split(resp, VARSEPARATOR);
-   for(string s: tokens){
-      vector<string> vartokens = split(s, VALSEPARATOR);
-      if(vartokens.size() == 3){
+   schema = resp;
+   Tokenizer tokens(resp, VARSEPARATOR[0], VALSEPARATOR[0]);
+   std::string_view vartokens[3];
+   unsigned int id = 0;
+   for(; int n = tokens.Next(vartokens, 3); id++){
+      if(n == 3){
          char set_or_var = vartokens[2][0];
-         int type = TypeConvert(vartokens[1]);
-         if(type>0){
-            if(set_or_var == 'S'){
-               sets.push_back(vartokens[0]);
-               stype.push_back(type);
-            } else if(set_or_var == 'V'){
-               vars.push_back(vartokens[0]);
-               vtype.push_back(type);
-            }
+         const LVType *type = FindType(TypeConvert(vartokens[1]));
+         if(type && (set_or_var == 'S' || set_or_var == 'V')){
+            std::string_view name = vartokens[0];
+            varset vs = (set_or_var == 'S') ? set : var;
+            int known = channels.Find(vs, name);
+            if(known >= 0 && unsigned(known) < nfixed)
+               fMfe->Msg(MERROR, "GetVars", "LabView variable %.*s has the name of a frontend setting, ignored", int(name.size()), name.data());
+            else
+               channels.Add(name, vs, type, id);
          }
       } else {
-         cerr << "Received bad string >" << s << "<" << endl;
+         cerr << "Received bad string >" << tokens.Record() << "<" << endl;
       }
    }
 
-   vector<string> newsets, newvars;
-   if(setselect.size() == 0 && varselect.size() == 0){
-      newsets = vector<string>(sets.begin() + fixedSets.size(), sets.end());
-      newvars = vector<string>(vars.begin() + fixedVars.size(), vars.end());
-   } else {
-      for(auto it = sets.begin() + fixedSets.size(); it != sets.end(); it++){
-         if(setselect.find(*it) == setselect.end())
-            newsets.push_back(*it);
-      }
-      for(auto it = vars.begin() + fixedVars.size(); it != vars.end(); it++){
-         if(varselect.find(*it) == varselect.end())
-            newvars.push_back(*it);
-      }
+   vector<unsigned int> newsets, newvars;
+   for(unsigned int i = nfixed; i < channels.size(); i++){
+      Channel &c = channels[i];
+      std::map<string,bool,std::less<> > &select = (c.vs == set) ? setselect : varselect;
+      auto it = select.find(c.name);
+      if(it == select.end())
+         ((c.vs == set) ? newsets : newvars).push_back(i);
+      else
+         c.selected = it->second;
+      std::map<string,Deadband,std::less<> > &deadband = (c.vs == set) ? setdeadband : vardeadband;
+      auto db = deadband.find(c.name);
+      if(db != deadband.end())
+         c.band = db->second;
    }
    if(newsets.size() || newvars.size()){
       std::ofstream selectfile(odbsfilename.c_str(), std::ios::app);
-      if(!select_exists) selectfile << "# Only edit final column, y to include in ODB, n to ignore." << endl;
-      for(auto s: newsets)
-         selectfile << s << VALSEPARATOR << 's' << VALSEPARATOR << 'x' << endl;
-      for(auto v: newvars)
-         selectfile << v << VALSEPARATOR << 'v' << VALSEPARATOR << 'x' << endl;
+      if(!select_exists){
+         selectfile << "# Only edit third column, y to include in ODB, n to ignore." << endl;
+         selectfile << "# Optional columns after it: absolute deadband, relative deadband, minimum ms between ODB writes." << endl;
+      }
+      for(unsigned int i: newsets)
+         selectfile << channels[i].name << VALSEPARATOR << 's' << VALSEPARATOR << 'x' << endl;
+      for(unsigned int i: newvars)
+         selectfile << channels[i].name << VALSEPARATOR << 'v' << VALSEPARATOR << 'x' << endl;
       fMfe->Msg(MINFO, "GetVars", "Wrote new ODB selection file %s, please edit and restart fe", odbsfilename.c_str());
       return 0;
    }
 
-   for(int i = sets.size()-1; i >= 0; i--){
-      if(!setselect[sets[i]]){
-         sets.erase(sets.begin()+i);
-         stype.erase(stype.begin()+i);
-      }
-   }
-   for(int i = vars.size()-1; i >= 0; i--){
-      if(!varselect[vars[i]]){
-         vars.erase(vars.begin()+i);
-         vtype.erase(vtype.begin()+i);
-      }
-   }
-   vector<string> odbsets, odbvars;
-   vector<int> odbstid, odbvtid;
-   vector<KEY> odbvarkeys;
    char tmpbuf[80];
+   HNDLE odbdir[2];
    sprintf(tmpbuf, "/Equipment/%s/Settings", fMfe->fFrontendName.c_str());
-   HNDLE odbs, odbv;
-   db_find_key(fMfe->fDB, 0, tmpbuf, &odbs);
+   db_find_key(fMfe->fDB, 0, tmpbuf, &odbdir[set]);
    sprintf(tmpbuf, "/Equipment/%s/Variables", fMfe->fFrontendName.c_str());
-   db_find_key(fMfe->fDB, 0, tmpbuf, &odbv);
-   db_scan_tree(fMfe->fDB, odbs, 0, add_key, (void*)&odbsetkeys);
-   db_scan_tree(fMfe->fDB, odbv, 0, add_key, (void*)&odbvarkeys);
-   auto it = odbsetkeys.begin();
-   while(it != odbsetkeys.end()){
-      if(std::find(fixedSets.begin(), fixedSets.end(), it->name) == fixedSets.end()){
-         odbsets.push_back(it->name);
-         odbstid.push_back(it->type);
-         it++;
-      } else {
-         it = odbsetkeys.erase(it);
-      }
-   }
-   for(KEY key: odbvarkeys){
-      if(std::find(fixedVars.begin(), fixedVars.end(), key.name) == fixedVars.end()){
-         odbvars.push_back(key.name);
-         odbvtid.push_back(key.type);
-      }
-   }
+   db_find_key(fMfe->fDB, 0, tmpbuf, &odbdir[var]);
+   vector<std::pair<HNDLE,KEY> > odbkeys[2];
+   db_scan_tree(fMfe->fDB, odbdir[set], 0, add_key, (void*)&odbkeys[set]);
+   db_scan_tree(fMfe->fDB, odbdir[var], 0, add_key, (void*)&odbkeys[var]);
    // fEq->fOdbEqSettings->ReadDir(&odbsets, &odbstid, &odbsnum, &tsize, &isize); // FIXME: function not implememnted!
    // fEq->fOdbEqVariables->ReadDir(&odbvars, &odbvtid, &odbvnum, &tsize, &isize);
-   if(verbose > 1){
-      for(unsigned int i = 0; i < odbsets.size(); i++){
-         cout << odbsets[i] << '\t' << odbstid[i] << endl;
-      }
-      for(unsigned int i = 0; i < odbvars.size(); i++){
-         cout << odbvars[i] << '\t' << odbvtid[i] << endl;
-      }
-   }
-   if(verbose){
-      if(odbsets == sets) cout << "Settings match!" << endl;
-      else {
-         std::set<string> sodbsets(odbsets.begin(), odbsets.end()), ssets(sets.begin(), sets.end()); // Using set so they're ordered
-         if(sodbsets == ssets) cout << "Settings match!" << endl;
-         else {
-            cout << "Settings don't match!" << endl;
-            cout << "LabView:\t";
-            for(string s: ssets) cout << s << '\t';
-            cout <<  endl;
-            cout << "ODB:    \t";
-            for(string s: sodbsets) cout << s << '\t';
-            cout <<  endl;
+
+   // match existing ODB keys to channels, anything left over is an orphan
+   odbsetkeys.clear();
+   int orphans = 0;
+   for(varset vs: {set, var}){
+      for(const std::pair<HNDLE,KEY> &k: odbkeys[vs]){
+         const KEY &key = k.second;
+         int i = channels.Find(vs, key.name);
+         if(i >= 0 && unsigned(i) < nfixed) continue;
+         if(verbose > 1) cout << key.name << '\t' << key.type << endl;
+         if(vs == set) odbsetkeys.push_back(key);
+         if(i < 0 || !channels[i].selected){
+            orphans++;
+            fMfe->Msg(MINFO, "GetVars", "Orphaned key: %s %s does not match available LabView %s", (vs == set) ? "Setting" : "Variable", key.name, (vs == set) ? "settings" : "variables");
+            continue;
          }
-      }
-   }
-   for(unsigned int i = 0; i < sets.size(); i++){
-      bool found = false;
-      if(!sets[i].size())
-         cerr << "Empty sets string at pos " << i << endl;
-      vector<string>::iterator it = std::find(odbsets.begin(), odbsets.end(), sets[i]);
-      if(it != odbsets.end()){
-         unsigned int j = distance(odbsets.begin(), it);
-         if((stype[i] == odbstid[j]) ||
-            (odbstid[j] == TID_INT32 && (stype[i] == TID_INT16 || stype[i] == TID_INT8 || stype[i] == TID_INT64)) ||
-            (odbstid[j] == TID_UINT32 && stype[i] == TID_UINT64) ||
-            (odbstid[j] == TID_UINT16 && stype[i] == TID_UINT8)){
-            found = true;
-         } else {
-            fMfe->Msg(MERROR, "GetVars", "Key %s exists, but has wrong type: %d instead of %d. Delete key manually to generate correct type.", sets[i].c_str(), odbstid[j], stype[i]);
+         Channel &c = channels[i];
+         int type = key.type;
+         if(type != c.type->tid && type != c.type->odbtid){
+            fMfe->Msg(MERROR, "GetVars", "Key %s exists, but has wrong type: %d instead of %d. Delete key manually to generate correct type.", key.name, type, c.type->odbtid);
             exit(DB_TYPE_MISMATCH);
             // don't want to delete keys automatically
          }
-      }
-      if(!found){
-         cout << "Creating key " << sets[i] << ", type " << stype[i] << endl;
-         if(stype[i] == TID_INT8 || stype[i] == TID_INT16 || stype[i] == TID_INT64)
-            db_create_key(fMfe->fDB, odbs, sets[i].c_str(), TID_INT32);
-         else if(stype[i] == TID_UINT64)
-            db_create_key(fMfe->fDB, odbs, sets[i].c_str(), TID_UINT32);
-         else if(stype[i] == TID_UINT8)
-            db_create_key(fMfe->fDB, odbs, sets[i].c_str(), TID_UINT16);
-         else
-            db_create_key(fMfe->fDB, odbs, sets[i].c_str(), stype[i]);
+         channels.SetKey(i, k.first);
       }
    }
-   for(unsigned int i = 0; i < vars.size(); i++){
-      bool found = false;
-      if(!vars[i].size())
-         cerr << "Empty vars string at pos " << i << endl;
-      vector<string>::iterator it = std::find(odbvars.begin(), odbvars.end(), vars[i]);
-      if(it != odbvars.end()){
-         unsigned int j = distance(odbvars.begin(), it);
-         if((vtype[i] == odbvtid[j]) ||
-            (odbvtid[j] == TID_INT32 && (vtype[i] == TID_INT16 || vtype[i] == TID_INT8 || vtype[i] == TID_INT64)) ||
-            (odbvtid[j] == TID_UINT32 && vtype[i] == TID_UINT64) ||
-            (odbvtid[j] == TID_UINT16 && vtype[i] == TID_UINT8)){
-            found = true;
-         } else {
-            fMfe->Msg(MERROR, "GetVars", "Key %s exists, but has wrong type: %d instead of %d. Delete key manually to generate correct type.", vars[i].c_str(), odbvtid[j], vtype[i]);
-            exit(DB_TYPE_MISMATCH);
-            // don't want to delete keys automatically
-         }
-      }
-      if(!found){
-         if(vtype[i] == TID_INT8 || vtype[i] == TID_INT16 || vtype[i] == TID_INT64)
-            db_create_key(fMfe->fDB, odbv, vars[i].c_str(), TID_INT32);
-         else if(vtype[i] == TID_UINT64)
-            db_create_key(fMfe->fDB, odbv, vars[i].c_str(), TID_UINT32);
-         else if(vtype[i] == TID_UINT8)
-            db_create_key(fMfe->fDB, odbv, vars[i].c_str(), TID_UINT16);
-         else
-            db_create_key(fMfe->fDB, odbv, vars[i].c_str(), vtype[i]);
-      }
+   if(verbose){
+      bool match = true;
+      for(unsigned int i = nfixed; i < channels.size(); i++)
+         match &= (channels[i].vs != set || !channels[i].selected || channels[i].hkey != 0);
+      for(const KEY &key: odbsetkeys) match &= (channels.Find(set, key.name) >= 0);
+      cout << (match ? "Settings match!" : "Settings don't match!") << endl;
    }
-   int orphans = 0;
-   for(unsigned int i = 0; i < odbsets.size(); i++){
-      vector<string>::iterator it = std::find(sets.begin(), sets.end(), odbsets[i]);
-      if(it == sets.end()){
-         orphans++;
-         fMfe->Msg(MINFO, "GetVars", "Orphaned key: Setting %s does not match available LabView settings", odbsets[i].c_str());
-         // message
-      } else {
-         // create hotlink
-         HNDLE hkey;
-         int status = db_find_key(fMfe->fDB, odbs, sets[i].c_str(), &hkey);
-         if (status != DB_SUCCESS) {
-            cm_msg(MERROR, "Init", "Key not found: %s", sets[i].c_str());
-         }
-         db_watch(fMfe->fDB, hkey, callback, (void*)this);
-      }
+
+   for(unsigned int i = nfixed; i < channels.size(); i++){
+      Channel &c = channels[i];
+      if(!c.selected || c.hkey) continue;
+      if(c.vs == set) cout << "Creating key " << c.name << ", type " << c.type->odbtid << endl;
+      db_create_key(fMfe->fDB, odbdir[c.vs], c.name.data(), c.type->odbtid);
+      HNDLE hkey = 0;
+      db_find_key(fMfe->fDB, odbdir[c.vs], c.name.data(), &hkey);
+      channels.SetKey(i, hkey);
    }
-   for(string s: odbvars){
-      vector<string>::iterator it = std::find(vars.begin(), vars.end(), s);
-      if(it == vars.end()){
-         orphans++;
-         fMfe->Msg(MINFO, "GetVars", "Orphaned key: Variable %s does not match available LabView variables", s.c_str());
-         // message
+   // hotlinks for settings changed in the ODB, variables are only written by us
+   for(unsigned int i = nfixed; i < channels.size(); i++){
+      if(!channels[i].selected) continue;
+      if(!channels[i].hkey){
+         // nowhere to write it, don't poll it either
+         cm_msg(MERROR, "Init", "Key not found: %s", channels[i].name.data());
+         channels[i].selected = false;
+         continue;
       }
+      if(channels[i].vs == set)
+         db_watch(fMfe->fDB, channels[i].hkey, callback, (void*)this);
+   }
+   for(unsigned int i = nfixed; i < channels.size(); i++){
+      if(channels[i].selected)
+         ((channels[i].vs == set) ? sets : vars).push_back(i);
    }
    if(orphans)
       fMfe->Msg(MINFO, "GetVars", "Orphaned keys in ODB found: %d", orphans);
-   return tokens.size();
+   return id;
 }
 
 void feLabview::fecallback(HNDLE hDB, HNDLE hkey, INT index)
 {
-   WriteLVSetFromODB(hkey);
+   int id = channels.FindKey(hkey);
+   if(id < 0) return;
+   Channel &c = channels[id];
+   if(!connected){
+      // keep the shadow value in step with the ODB
+      (this->*c.type->cache)(c);
+      c.unsent = true;
+      fMfe->Msg(MINFO, "fecallback", "Not connected to LabView, %s is sent after reconnecting", c.name.data());
+      return;
+   }
+   if((this->*c.type->write)(c)) c.unsent = false;
 }
 
-bool feLabview::LVtoODB(const varset vs, const string name, const int type)
+/** \brief Queue value for ODB if it differs from the current ODB value.
+ *
+ * Compares with the shadow value of the channel, ODB is only read the first time.
+ * Hotlinks keep the shadow value of settings up to date if someone else writes them,
+ * variables are only written by this frontend. The new value goes to ODB with the next
+ * CommitODB(). Numeric changes within the deadband of the channel are dropped, the next
+ * change is again compared with the value in ODB, so slow drifts still get written once
+ * they add up.
+ */
+template <class T>
+void feLabview::ValToODB(Channel &c, const T &val)
 {
-   bool success = false;
-   switch(type){
-   case TID_BOOL:
-      {
-         bool val, odbval;
-         ReadODB(vs, name, type, odbval);
-         success = ReadLVVar(vs, name, type, val);
-         if(val != odbval)
-            WriteODB(vs, name, type, val);
-         break;
-      }
-   case TID_INT8:
-   case TID_INT16:
-   case TID_INT64:
-   case TID_INT32:
-      {
-         int val, odbval;
-         ReadODB(vs, name, type, odbval);
-         success = ReadLVVar(vs, name, type, val);
-         if(val != odbval)
-            WriteODB(vs, name, type, val);
-         break;
+   if(std::holds_alternative<std::monostate>(c.last))
+      CacheODB<T>(c);
+   const T &last = std::get<T>(c.last);
+   if(val == last)
+      return;
+   if constexpr (std::is_arithmetic_v<T> && !std::is_same_v<T,bool>){
+      // NaN never compares as within the deadband, changes from or to NaN always go through
+      double diff = fabs(double(val) - double(last));
+      if(diff <= c.band.abs || diff <= c.band.rel*fabs(double(last)))
+         return;
+   }
+   c.last = val;
+   if(!c.changed){
+      c.changed = true;
+      changed.push_back(channels.Id(c));
+   }
+}
+
+/** \brief Write all values changed since the last call to ODB, returns number of keys updated.
+ *
+ * Holds the ODB lock once for all of them, each value is written by its key handle.
+ * Channels written less than their minimum interval ago stay queued for a later call,
+ * with the latest value they received in the meantime.
+ */
+int feLabview::CommitODB()
+{
+   if(changed.empty()) return 0;
+   int n = 0;
+   unsigned int held = 0;
+   bool locked = false;
+   double now = TMFE::GetTime();
+   for(unsigned int id: changed){
+      Channel &c = channels[id];
+      if(now < c.next_write){
+         changed[held++] = id;
+         continue;
       }
-   case TID_DOUBLE:
-      {
-         double val, odbval;
-         ReadODB(vs, name, type, odbval);
-         success = ReadLVVar(vs, name, type, val);
-         if(val != odbval)
-            WriteODB(vs, name, type, val);
-         break;
+      if(!locked){
+         db_lock_database(fMfe->fDB);
+         locked = true;
       }
-   case TID_FLOAT:
-      {
-         float val, odbval;
-         ReadODB(vs, name, type, odbval);
-         success = ReadLVVar(vs, name, type, val);
-         if(val != odbval)
-            WriteODB(vs, name, type, val);
-         break;
+      c.changed = false;
+      c.next_write = now + c.band.interval;
+      int status = std::visit([&](const auto &val){
+            if constexpr (std::is_same_v<std::decay_t<decltype(val)>, std::monostate>){
+               return int(DB_SUCCESS);
+            } else {
+               if(verbose > 2) cout << "Writing to ODB: " << c.name << "\tvalue: " << val << endl;
+               return SetODBData(c.hkey, val);
+            }
+         }, c.last);
+      if(status == DB_SUCCESS){
+         n++;
+      } else {
+         cm_msg(MERROR, "CommitODB", "Cannot write %s to ODB, status %d", c.name.data(), status);
+         c.last = std::monostate();
       }
-   case TID_STRING:
-      {
-         string val, odbval;
-         ReadODB(vs, name, type, odbval);
-         success = ReadLVVar(vs, name, type, val);
-         if(val != odbval)
-            WriteODB(vs, name, type, val);
-         break;
+   }
+   if(locked) db_unlock_database(fMfe->fDB);
+   changed.resize(held);
+   return n;
+}
+
+/** \brief Read a list of variables with one binary \c BINREAD frame, returns number of failed variables. */
+int feLabview::BinToODB(const vector<unsigned int> &ids)
+{
+   int errors = 0;
+   for(unsigned int i = 0; i < ids.size(); i += 0xffff){
+      unsigned int n = std::min<unsigned int>(0xffff, ids.size() - i);
+      string frame(1, BINREAD);
+      PutBE(frame, uint16_t(n));
+      for(unsigned int j = 0; j < n; j++)
+         PutBE(frame, uint16_t(channels[ids[i+j]].lvid));
+      string resp;
+      if(!WriteFrame(frame) || !ReadFrame(resp)){
+         errors += n;
+         continue;
       }
-   case TID_UINT8:
-   case TID_UINT16:
-      {
-         uint16_t val, odbval;
-         ReadODB(vs, name, type, odbval);
-         success = ReadLVVar(vs, name, type, val);
-         if(val != odbval)
-            WriteODB(vs, name, type, val);
-         break;
+      const char *p = resp.data(), *end = resp.data() + resp.size();
+      uint16_t count = 0;
+      if(resp.size() < 3 || *p++ != BINVALUE || !GetBE(p, end, count) || count != n){
+         cm_msg(MERROR, "BinToODB", "Asked for %u variables, got malformed reply", n);
+         errors += n;
+         continue;
       }
-   case TID_UINT64:
-   case TID_UINT32:
-      {
-         uint32_t val, odbval;
-         ReadODB(vs, name, type, odbval);
-         success = ReadLVVar(vs, name, type, val);
-         if(val != odbval)
-            WriteODB(vs, name, type, val);
-         break;
+      for(unsigned int j = 0; j < n; j++){
+         const Channel &c = channels[ids[i+j]];
+         uint16_t id;
+         if(!GetBE(p, end, id) || id != c.lvid){
+            cm_msg(MERROR, "BinToODB", "Asked for %s, but got id %d", c.name.data(), id);
+            errors += n - j;
+            break;
+         }
+         if(!BinToODB(ids[i+j], p, end)){
+            cm_msg(MERROR, "BinToODB", "Bad binary value for %s", c.name.data());
+            errors += n - j;
+            break;
+         }
       }
    }
-   return success;
+   return errors;
 }
 
 bool feLabview::SyncSettings()
@@ -897,27 +1282,266 @@ bool feLabview::SyncSettings()
          success &= WriteLVSetFromODB(key);
       }
    } else {                     // copy LabView settings to ODB
-      for(unsigned int i = 0; i < sets.size(); i++){
-         success &= LVtoODB(set, sets[i], stype[i]);
-      }
+      success = (LVtoODB(sets) == 0);
+      CommitODB();
    }
    return success;
 }
 
-INT feLabview::read_event()
+/** \brief Copy a list of LabView variables to the ODB, returns number of failed variables.
+ *
+ * With \c batchRead > 0 the variables are requested in chunks of that size with one
+ * "read:name1;name2;..." command per chunk, LabView answers "name1:value1;name2:value2;..."
+ * on a single line. If LabView never answers the batched command, batching is switched
+ * off and every variable is read separately. Once it did, a missing reply only fails its
+ * chunk, a chunk with the wrong number of values is read again one by one. Up to
+ * \c pipelineDepth requests are in flight per connection, spread over all \c connections
+ * to LabView.
+ */
+int feLabview::LVtoODB(const vector<unsigned int> &ids)
 {
+   if(binary) return BinToODB(ids);
    int errors = 0;
-   for(unsigned int i = 0; i < sets.size(); i++){
-      if(!LVtoODB(set, sets[i], stype[i]))
-         errors++;
+   if(batch_size > 0 && ids.size()){
+      // use at least one batch per connection, so the pool polls in parallel
+      unsigned int chunk = batch_size;
+      unsigned int nconn = Connections();
+      if(nconn > 1) chunk = std::min<unsigned int>(chunk, (ids.size() + nconn - 1)/nconn);
+      batch_requests.resize((ids.size() + chunk - 1)/chunk);
+      requests.clear(); expected.clear();
+      for(unsigned int i = 0; i < ids.size(); i += chunk){
+         string &req = batch_requests[i/chunk];
+         req.assign("read" VALSEPARATOR);
+         for(unsigned int j = i; j < ids.size() && j < i + chunk; j++){
+            if(j > i) req += VARSEPARATOR;
+            req += channels[ids[j]].name;
+         }
+         req += "\r\n";
+         requests.push_back(req);
+         expected.push_back(channels[ids[i]].Prefix());
+      }
+      Exchange(requests, expected, replies, pipeline_depth, 0);
+      for(unsigned int k = 0; !batch_works && k < replies.size(); k++)
+         batch_works = replies[k].size();
+      if(batch_works || DeadlineExpired()){
+         for(unsigned int k = 0; k < replies.size(); k++){
+            unsigned int i = k*chunk;
+            unsigned int n = std::min<unsigned int>(chunk, ids.size() - i);
+            if(verbose>2) cout << "LVtoODB Sent: " << requests[k] << "\tReceived: " << replies[k] << endl;
+            if(!replies[k].size()){
+               // timed out or out of time for this poll cycle, not a protocol problem
+               errors += n;
+               continue;
+            }
+            Tokenizer values(replies[k], VARSEPARATOR[0]);
+            unsigned int nvalues = values.Count();
+            if(nvalues != n){
+               // e.g. a string value containing the separator, read this chunk one by one
+               cm_msg(MERROR, "LVtoODB", "Asked for %d variables, but got %d", int(n), int(nvalues));
+               for(unsigned int j = 0; j < n; j++){
+                  if(DeadlineExpired() || !LVtoODB(ids[i+j]))
+                     errors++;
+               }
+               continue;
+            }
+            std::string_view value;
+            for(unsigned int j = 0; j < n && values.Next(value); j++){
+               if(!LVtoODB(ids[i+j], &value))
+                  errors++;
+            }
+         }
+         return errors;
+      }
+      // not a single answer to read: so far, LabView does not know the command
+      fMfe->Msg(MERROR, "LVtoODB", "LabView does not answer batched reads, falling back to reading variables one by one");
+      batch_size = 0;
+   }
+   if(pipeline_depth > 1 || Connections() > 1){
+      requests.clear(); expected.clear();
+      for(unsigned int id: ids){
+         requests.push_back(channels[id].request);
+         expected.push_back(channels[id].Prefix());
+      }
+      Exchange(requests, expected, replies, pipeline_depth);
+      for(unsigned int i = 0; i < replies.size(); i++){
+         if(!replies[i].size() && DeadlineExpired())
+            errors++;
+         else{
+            std::string_view reply = replies[i];
+            if(!LVtoODB(ids[i], &reply))
+               errors++;
+         }
+      }
+      return errors;
    }
-   for(unsigned int i = 0; i < vars.size(); i++){
-      if(!LVtoODB(var, vars[i], vtype[i]))
+   for(unsigned int i = 0; i < ids.size(); i++){
+      if(DeadlineExpired()){
+         errors += ids.size() - i;
+         break;
+      }
+      if(!LVtoODB(ids[i]))
          errors++;
    }
    return errors;
 }
 
+/** \brief Read all settings and variables from LabView, returns number of failed values.
+ *
+ * Changed values are written to ODB together at the end, see CommitODB().
+ * With \c cycleBudget > 0 the whole cycle has to finish within that many milliseconds.
+ * Values not read in time keep their old ODB value and are picked up in the next cycle,
+ * they only count as errors if nothing could be read at all.
+ */
+INT feLabview::read_event()
+{
+   int errors = 0;
+   if(cycle_budget > 0) SetDeadline(KOtcpConnection::Now() + 0.001*cycle_budget);
+   errors += LVtoODB(sets);
+   errors += LVtoODB(vars);
+   int updated = CommitODB();
+   if(verbose > 1) cout << "read_event: " << updated << " ODB keys updated" << endl;
+   if(cycle_budget > 0){
+      bool expired = DeadlineExpired();
+      SetDeadline(0);
+      if(expired){
+         int total = sets.size() + vars.size();
+         if(verbose) cout << "read_event: cycle exceeded " << cycle_budget << " ms, " << errors << " of " << total << " values not updated" << endl;
+         if(errors < total) errors = 0;
+      }
+   }
+   return errors;
+}
+
+/** \brief Ask LabView to push changed values.
+ *
+ * Sends "subscribe:name1;name2;..." with all selected settings and variables, LabView
+ * confirms with "subscribe:<n>" and from then on sends "name:value" whenever a value
+ * changes. Those lines are applied to the ODB by ReadUpdates(). Returns \c false and
+ * keeps periodic polling if LabView does not support subscriptions.
+ */
+bool feLabview::Subscribe()
+{
+   subscribed = false;
+   fAcceptPushed = false;
+   if(!use_subscribe) return false;
+   if(binary){
+      fMfe->Msg(MINFO, "Subscribe", "Subscriptions are not supported with the binary protocol, polling");
+      return false;
+   }
+   std::ostringstream oss;
+   oss << "subscribe" << VALSEPARATOR;
+   std::set<std::string_view> names;
+   for(unsigned int id: sets) names.insert(channels[id].name);
+   for(unsigned int id: vars) names.insert(channels[id].name);
+   for(auto it = names.begin(); it != names.end(); it++){
+      if(it != names.begin()) oss << VARSEPARATOR;
+      oss << *it;
+   }
+   oss << "\r\n";
+   string resp = Exchange(oss.str(), true, string("subscribe") + VALSEPARATOR);
+   if(!resp.size()){
+      fMfe->Msg(MINFO, "Subscribe", "LabView does not support subscriptions, polling");
+      return false;
+   }
+   fMfe->Msg(MINFO, "Subscribe", "Subscribed to %s variables", resp.substr(resp.find(VALSEPARATOR)+1).c_str());
+   fAcceptPushed = true;
+   subscribed = true;
+   read_event();                // pick up values that changed before the subscription
+   return true;
+}
+
+/** \brief Re-establish a lost connection to LabView, with exponential backoff.
+ *
+ * Only the handshake is repeated, the variable list and ODB hotlinks from GetVars() are
+ * kept as long as LabView still reports the same list:vars reply. A changed variable list
+ * needs a new selection, in that case the frontend gives up and exits. No reply at all is
+ * retried like a failed connection, LabView may still be starting up. Settings changed in
+ * ODB while disconnected are sent once the connection is back.
+ */
+bool feLabview::Reconnect()
+{
+   double now = TMFE::GetTime();
+   if(now < next_reconnect) return false;
+   string resp;
+   if(LVConnect()){
+      Exchange("list:vars\r\n", resp, true, "", 0);
+      if(resp.size() && resp != schema){
+         fMfe->Msg(MERROR, "Reconnect", "LabView variable list changed, terminating.");
+         connected = false;
+         failed = true;
+         return false;
+      }
+      if(!resp.size()){
+         cerr << "Reconnect: no variable list from LabView" << endl;
+         TCPClose();
+         connected = false;
+      }
+   }
+   if(connected){
+      StartSession();
+      for(unsigned int id: sets){
+         Channel &c = channels[id];
+         if(!c.unsent) continue;
+         if((this->*c.type->write)(c)) c.unsent = false;
+         else fMfe->Msg(MERROR, "Reconnect", "Setting %s changed while disconnected could not be sent to LabView", c.name.data());
+      }
+      fails = 0;
+      reconnect_delay = 0;
+      std::ostringstream oss;
+      oss << "Connected to " << fHostname << ':' << fPortnum;
+      fEq->SetStatus(oss.str().c_str(), "lightgreen");
+      fMfe->Msg(MINFO, "Reconnect", "Reconnected to LabView");
+      Subscribe();
+      return true;
+   }
+   // double the delay on every failure, randomized so several frontends don't retry in lockstep
+   reconnect_delay = reconnect_delay > 0 ? std::min(2*reconnect_delay, reconnect_max) : reconnect_min;
+   next_reconnect = now + reconnect_delay*(0.5 + drand48());
+   if(verbose) cout << "Reconnect failed, next attempt in " << next_reconnect - now << "s" << endl;
+   return false;
+}
+
+/** \brief Ping LabView on an idle connection.
+ *
+ * Repeats the "midas" handshake if nothing was received for \c heartbeat ms, which with
+ * subscriptions or long polling periods finds a dead LabView before the next real request.
+ * A missing answer starts reconnection. Not used with the binary protocol, where kernel
+ * keepalive has to do.
+ */
+void feLabview::Heartbeat()
+{
+   if(!connected || binary || heartbeat <= 0) return;
+   if(KOtcpConnection::Now() - LastReceived() < 0.001*heartbeat) return;
+   string resp = Exchange("midas\r\n", true, "labview");
+   if(!resp.size()){
+      fMfe->Msg(MERROR, "Heartbeat", "LabView did not answer, reconnecting.");
+      ConnectionLost();
+   }
+}
+
+/** \brief Apply all values pushed by LabView since the last call, returns number of updates. */
+int feLabview::ReadUpdates()
+{
+   int n = 0;
+   string line;
+   while(connected && subscribed && ReadPushed(line)){
+      std::string_view update = line;
+      std::string_view name = update.substr(0, update.find(VALSEPARATOR));
+      bool found = false;
+      for(varset vs: {set, var}){
+         int id = channels.Find(vs, name);
+         if(id >= 0 && channels[id].selected){
+            found = true;
+            LVtoODB(id, &update);
+         }
+      }
+      if(found) n++;
+      else if(verbose > 1) cout << "Ignoring update for unknown variable: " << line << endl;
+   }
+   CommitODB();
+   return n;
+}
+
 bool feLabview::ReadSelectFile()
 {
    std::ifstream selectfile(odbsfilename.c_str());
@@ -932,15 +1556,25 @@ bool feLabview::ReadSelectFile()
          break;
       }
       if(line.at(0) == '#') continue;
-      vector<string> tokens = split(line, VALSEPARATOR);
-      if(tokens.size() != 3){
+      std::string_view tokens[6];
+      int n = Tokenizer(line, '\n', VALSEPARATOR[0]).Next(tokens, 6);
+      if(n < 3 || n > 6){
          break;
       }
-      if(tokens[1] == string("v"))
-         varselect[tokens[0]] = (tokens[2] == string("1") || tokens[2] == string("y"));
-      else if(tokens[1] == string("s"))
-         setselect[tokens[0]] = (tokens[2] == string("1") || tokens[2] == string("y"));
-      else { fMfe->Msg(MERROR, "ReadSelectFile", "Unknown entry %s in ODB selection file %s", tokens[1].c_str(), odbsfilename.c_str());
+      Deadband band;
+      double ms = 0;
+      if((n > 3 && !GetText(tokens[3], band.abs)) || (n > 4 && !GetText(tokens[4], band.rel)) || (n > 5 && !GetText(tokens[5], ms))){
+         fMfe->Msg(MERROR, "ReadSelectFile", "Bad deadband for %.*s in ODB selection file %s", int(tokens[0].size()), tokens[0].data(), odbsfilename.c_str());
+         return false;
+      }
+      band.interval = 0.001*ms;
+      if(tokens[1] == "v"){
+         varselect[string(tokens[0])] = (tokens[2] == "1" || tokens[2] == "y");
+         if(n > 3) vardeadband[string(tokens[0])] = band;
+      } else if(tokens[1] == "s"){
+         setselect[string(tokens[0])] = (tokens[2] == "1" || tokens[2] == "y");
+         if(n > 3) setdeadband[string(tokens[0])] = band;
+      } else { fMfe->Msg(MERROR, "ReadSelectFile", "Unknown entry %.*s in ODB selection file %s", int(tokens[1].size()), tokens[1].data(), odbsfilename.c_str());
          return false;
       }
       selectfile.peek();
@@ -968,6 +1602,7 @@ int main(int argc, char* argv[])
    // setbuf(stderr, NULL);
 
    signal(SIGPIPE, SIG_IGN);
+   srand48(time(NULL) ^ getpid()); // reconnect jitter
 
    std::string name = "";
 
@@ -1019,6 +1654,7 @@ int main(int argc, char* argv[])
    } else {
       connected = (myfe->GetVars() > 0);
    }
+   if(connected) myfe->StartSession();
    // char rot_set_str[80];
    // HNDLE hkey;
    // sprintf(rot_set_str, "/Equipment/%s/Settings/Rotation_position", name.c_str());
@@ -1037,8 +1673,15 @@ int main(int argc, char* argv[])
       eq->SetStatus(oss.str().c_str(), "lightgreen");
 
       myfe->SyncSettings();
-      while (!mfe->fShutdownRequested && myfe->Connected()) {
+      myfe->Subscribe();
+      while (!mfe->fShutdownRequested && !myfe->Failed()) {
          mfe->PollMidas(10);
+         if(myfe->Connected()){
+            myfe->ReadUpdates();
+            myfe->Heartbeat();
+         } else {
+            myfe->Reconnect();
+         }
       }
    }
    mfe->Disconnect();
@@ -4,8 +4,10 @@
 '''
 
 import socket
+import struct
 import sys
 import argparse
+import os
 
 # HOST = ''	# Symbolic name, meaning all available interfaces
 
@@ -27,6 +29,29 @@ settings = {
         'HomeRot' : ['Boolean', 0]
 }
 
+## MIDAS TID and struct format of LabView types for the binary protocol
+bintypes = {
+        'Boolean' : (8, 'B'),
+        'I8' : (2, 'b'),
+        'I16' : (5, 'h'),
+        'I32' : (7, 'i'),
+        'I64' : (17, 'q'),
+        'U8' : (1, 'B'),
+        'U16' : (4, 'H'),
+        'U32' : (6, 'I'),
+        'U64' : (18, 'Q'),
+        'Single Float' : (9, 'f'),
+        'Double Float' : (10, 'd'),
+        'String' : (12, None)
+}
+
+## Variable IDs for the binary protocol, position in the list_vars reply
+ids = []
+binary = False
+
+## Names LabView pushes changes for
+subscribed = set()
+
 
 def answer(msg):
         """
@@ -36,21 +61,48 @@ def answer(msg):
 
         list_vars to receive a list of available variables
         <varname>:? to query value of variable <varname>
+        read:<var1>;<var2>;... to query several variables at once
         <varname>:<value> to change value of variable <varname>
+        protocol:binary to switch to the binary protocol, see answer_frame()
+        subscribe:<var1>;<var2>;... to receive "<varname>:<value>" whenever a value changes
         """
+        global binary
         msg = msg.strip("\r\n ")
         print >>sys.stderr, 'received "%s"' % msg
         if(msg == "midas"):
                 conn.sendall("labview(fake)\r\n")
-        elif(msg == "list_vars"):
+        elif(msg == "protocol:binary"):
+                conn.sendall("protocol:binary/1\r\n")
+                binary = True
+        elif(msg == "list_vars" or msg == "list:vars"):
                 varlist = ""
+                del ids[:]
                 for key in vars:
                         varlist = varlist + key + ":" + vars[key][0] + ":V;"
+                        ids.append(vars[key])
                         print(varlist)
                 for key in settings:
                         varlist = varlist + key + ":" + settings[key][0] + ":S;"
+                        ids.append(settings[key])
                         print(varlist)
                 conn.sendall(varlist + "\r\n")
+        elif(msg.startswith("subscribe:")):
+                subscribed.clear()
+                for cmd in msg[10:].split(';'):
+                        if(cmd in vars or cmd in settings):
+                                subscribed.add(cmd)
+                conn.sendall("subscribe:" + str(len(subscribed)) + "\r\n")
+        elif(msg.startswith("read:")):
+                values = []
+                for cmd in msg[5:].split(';'):
+                        if(cmd in vars):
+                                values.append(cmd + ":" + str(vars[cmd][1]))
+                        elif(cmd in settings):
+                                values.append(cmd + ":" + str(settings[cmd][1]))
+                        else:
+                                print "Unknown variable:", cmd
+                                values.append(cmd + ":")
+                conn.sendall(";".join(values) + "\r\n")
         else:
                 (cmd,arg) = msg.split(':',2)
                 print cmd, arg
@@ -64,21 +116,83 @@ def answer(msg):
                 elif(cmd in settings):
                         settings[cmd][1] = arg
                         print "Changed", cmd, "to", arg
+                        if(cmd in subscribed):
+                                conn.sendall(cmd + ":" + str(arg) + "\r\n")
                 else:
                         print "Unknown command:", cmd
 
 
+def pack_value(var):
+        """
+        Encode variable as MIDAS TID byte and big-endian value.
+        """
+        (tid, fmt) = bintypes[var[0]]
+        if(fmt is None):
+                val = str(var[1])
+                return struct.pack('>BH', tid, len(val)) + val
+        elif(fmt in 'fd'):
+                return struct.pack('>B' + fmt, tid, float(var[1]))
+        else:
+                return struct.pack('>B' + fmt, tid, int(float(var[1])))
+
+
+def unpack_value(var, data):
+        """
+        Decode MIDAS TID byte and big-endian value into variable.
+        """
+        (tid, fmt) = bintypes[var[0]]
+        if(fmt is None):
+                (n,) = struct.unpack('>H', data[1:3])
+                var[1] = data[3:3+n]
+        else:
+                (var[1],) = struct.unpack('>' + fmt, data[1:1+struct.calcsize(fmt)])
+
+
+def answer_frame(frame):
+        """
+        Respond to binary frames from Midas frontend for LabView.
+
+        R n id_1 ... id_n to read variables, answered with V n id_1 value_1 ... id_n value_n
+        W id value to change a setting, answered with V 1 id value
+        """
+        op = frame[0]
+        if(op == 'R'):
+                (n,) = struct.unpack('>H', frame[1:3])
+                reply = 'V' + struct.pack('>H', n)
+                for i in range(n):
+                        (vid,) = struct.unpack('>H', frame[3+2*i:5+2*i])
+                        reply = reply + struct.pack('>H', vid) + pack_value(ids[vid])
+        elif(op == 'W'):
+                (vid,) = struct.unpack('>H', frame[1:3])
+                unpack_value(ids[vid], frame[3:])
+                print "Changed", vid, "to", ids[vid][1]
+                reply = 'V' + struct.pack('>HH', 1, vid) + pack_value(ids[vid])
+        else:
+                print "Unknown frame:", op
+                return
+        conn.sendall(struct.pack('>I', len(reply)) + reply)
+
+
 argparser = argparse.ArgumentParser()
 argparser.add_argument("-H","--host",help="Host for the server socket to be, default localhost",type=str,default="localhost")
 argparser.add_argument("-p","--port",help="Port for the server socket, default 8888",type=int,default=8888)
+argparser.add_argument("-u","--unix",help="Listen on this Unix domain socket instead, use hostname unix:<path> in the frontend",type=str,default="")
 args = argparser.parse_args()
 
-s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+if args.unix:
+        if os.path.exists(args.unix):
+                os.unlink(args.unix)
+        s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+else:
+        s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
 print 'Socket created'
 
 #Bind socket to local host and port
 try:
-	s.bind((args.host, args.port))
+	if args.unix:
+		s.bind(args.unix)
+	else:
+		s.bind((args.host, args.port))
 except socket.error as msg:
 	print 'Bind failed. Error Code : ' + str(msg[0]) + ' Message ' + msg[1]
 	sys.exit()
@@ -88,20 +202,37 @@ print 'Socket bind complete'
 #Start listening on socket
 try:
         s.listen(10)
-        print 'Socket now listening on', args.host, ":", args.port
+        if args.unix:
+                print 'Socket now listening on', args.unix
+        else:
+                print 'Socket now listening on', args.host, ":", args.port
 
         #now keep talking with the client
         while 1:
                 #wait to accept a connection - blocking call
 	        conn, addr = s.accept()
-	        print 'Connected with ' + addr[0] + ':' + str(addr[1])
+	        print 'Connected with', addr
+	        binary = False
+	        subscribed.clear()
 	        try:
                         print >>sys.stderr, 'client connected:', addr
+                        buf = ""
                         while True:
-                                data = conn.recv(80)
+                                data = conn.recv(4096)
 
                                 if data:
-                                        answer(data)
+                                        # requests may be pipelined, answer every complete line
+                                        buf = buf + data
+                                        while binary and len(buf) >= 4:
+                                                (n,) = struct.unpack('>I', buf[:4])
+                                                if(len(buf) < 4 + n):
+                                                        break
+                                                answer_frame(buf[4:4+n])
+                                                buf = buf[4+n:]
+                                        while not binary and "\n" in buf:
+                                                (line, buf) = buf.split("\n", 1)
+                                                if line.strip("\r "):
+                                                        answer(line)
                                 else:
                                         break
                 finally:
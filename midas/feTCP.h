@@ -6,6 +6,11 @@
 #include <assert.h> // assert()
 #include <stdlib.h> // malloc()
 #include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <map>
+#include <algorithm> // std::max()
 #include <iostream>
 /// replace these with midas tcpip.o?
 #include <unistd.h>
@@ -13,6 +18,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <arpa/inet.h> // htonl()
 #include <netdb.h>
 
 #include "midas.h"
@@ -21,6 +27,7 @@
 #include "KOtcp.h"
 
 using std::string;
+using std::vector;
 using std::cout;
 using std::cerr;
 using std::endl;
@@ -34,6 +41,12 @@ public TMFeRpcHandlerInterface,
 {
  private:
    KOtcpConnection *tcp = NULL;
+   std::deque<std::pair<std::string_view,double> > fPending; ///< expected reply prefix and send time of requests on the wire, oldest first
+   double fLastReply = 0;       ///< time the last reply on the main connection arrived
+   double fLastReceived = 0;    ///< time the last reply or pushed line on the main connection arrived
+   std::deque<string> fPushed;  ///< unsolicited lines received while waiting for a reply
+   vector<KOtcpConnection*> fPool; ///< additional connections to the same server, see OpenPool()
+   string fPoolGreeting, fPoolExpected; ///< handshake of pool connections, to replace failed ones
  public:
    TMFE* fMfe;
    TMFeEquipment* fEq;
@@ -42,6 +55,7 @@ public TMFeRpcHandlerInterface,
    char* fEventBuf;
    string fHostname = "localhost";
    string fPortnum ="8888";
+   bool fAcceptPushed = false;  ///< server may send unsolicited lines in between replies
    //int fPortnum = 4711;
    int fSockFd;
 
@@ -56,6 +70,7 @@ public TMFeRpcHandlerInterface,
 
    ~feTCP() // dtor
       {
+         ClosePool();
          if (fEventBuf) {
             free(fEventBuf);
             fEventBuf = NULL;
@@ -122,15 +137,32 @@ public TMFeRpcHandlerInterface,
       //fEq->fOdbEqSettings->RI("port", &fPortnum, true);
       fEq->fOdbEqSettings->RS("port", &fPortnum, true);
       cout << "Hostname: " << fHostname << ", port " << fPortnum << endl;
+      ClosePool();
+      // nothing from the old connection must be taken for a reply or update on the new one
+      fPending.clear();
+      fPushed.clear();
       if(tcp){
          delete tcp;
       }
       //char portstr[8];
       //sprintf(portstr,"%d",fPortnum);
+      int min_timeout = 20, max_timeout = 2000;
+      fEq->fOdbEqSettings->RI("readTimeoutMin", &min_timeout, true);
+      fEq->fOdbEqSettings->RI("readTimeoutMax", &max_timeout, true);
+      int keepalive = 10, user_timeout = 10000;
+      fEq->fOdbEqSettings->RI("keepAlive", &keepalive, true);
+      fEq->fOdbEqSettings->RI("userTimeout", &user_timeout, true);
+      bool io_uring = false;
+      fEq->fOdbEqSettings->RB("ioUring", &io_uring, true);
       tcp = new KOtcpConnection(fHostname.c_str(),fPortnum.c_str());
       tcp->fConnectTimeoutMilliSec = 500;
-      tcp->fReadTimeoutMilliSec = 2000;
+      tcp->fReadTimeoutMilliSec = max_timeout; // until the first round trip is measured
+      tcp->fMinReadTimeoutMilliSec = min_timeout;
+      tcp->fMaxReadTimeoutMilliSec = max_timeout;
       tcp->fWriteTimeoutMilliSec = 500;
+      tcp->fKeepAliveSec = keepalive;
+      tcp->fUserTimeoutMilliSec = user_timeout;
+      tcp->fUseUring = io_uring;
       //tcp = new KOtcpConnection(fHostname.c_str(), portstr);
       KOtcpError err = tcp->Connect();
       if(err.error){
@@ -138,50 +170,413 @@ public TMFeRpcHandlerInterface,
          return false;
       } else {
          cout << "Connected." << endl;
+         fLastReceived = KOtcpConnection::Now();
          return true;
       }
    }
 
+   /** \brief Close the main connection and the pool, outstanding requests are dropped. */
+   void TCPClose()
+   {
+      ClosePool();
+      fPending.clear();
+      if(tcp) tcp->Close();
+   }
+
+   /** \brief KOtcpConnection::Now() time the server last sent anything on the main connection. */
+   double LastReceived() const { return fLastReceived; }
+
+   /** \brief \c true while the main connection to the server is open. */
+   bool TCPConnected() const { return tcp && tcp->fConnected; }
+
    /** \brief Send string over TCP, optionally receive reply.
     *
     * \param message text to be sent to server
+    * \param resp response, empty if none was received. Reusing the same buffer avoids allocations
     * \param expect_reply try to receive a response
+    * \param expected required beginning of the response
+    * \param max_length maximum length of the response, 0 for no limit
     */
-   string Exchange(string message, bool expect_reply = true, string expected = ""){
+   bool Exchange(std::string_view message, string &resp, bool expect_reply = true, std::string_view expected = "", unsigned max_length = 4096){
+      resp.clear();
+      if(fPending.size()){
+         cerr << "Exchange: discarding " << fPending.size() << " outstanding replies" << endl;
+         while(fPending.size()) Collect(resp);
+         resp.clear();
+      }
+      if(Post(message, expect_reply, expected) && expect_reply)
+         Collect(resp, max_length);
+      return resp.size();
+   }
+
+   /** \brief Exchange() returning the response. */
+   string Exchange(std::string_view message, bool expect_reply = true, std::string_view expected = "", unsigned max_length = 4096){
       string resp;
-      if(tcp){
-         if(tcp->fConnected){
-            KOtcpError err;
-            err = tcp->WriteString(message);
-            if(err.error){
-               cerr << err.message << endl;
-               return resp;
-            }
-            if(expect_reply){
-               err = tcp->ReadString(&resp,4096);
-               if(!resp.size()){
-                  usleep(100000);
-                  err = tcp->ReadString(&resp,4096);
-                  if(!resp.size()){
-                     cerr << "Response empty even on second try" << endl;
-                     return resp;
-                  }
-               }
+      Exchange(message, resp, expect_reply, expected, max_length);
+      return resp;
+   }
+
+   /** \brief Pipelined exchange, keeps up to \p depth requests on the wire.
+    *
+    * Replies are stored in \p replies in the order of \p messages, each one matched against the
+    * corresponding entry of \p expected like in Exchange(). Failed requests give an empty reply.
+    * The strings of \p replies are reused, so polling with the same vector does not allocate.
+    *
+    * \param messages requests to be sent to server
+    * \param expected required beginning of each response
+    * \param replies responses, resized to the number of messages
+    * \param depth maximum number of outstanding requests, 0 for no limit
+    * \param max_length maximum length of each response, 0 for no limit
+    *
+    * Once the deadline set with SetDeadline() has passed no further requests are sent,
+    * their replies are left empty. So are the replies of all requests on the wire when
+    * one of them fails.
+    */
+   void Exchange(const vector<std::string_view> &messages, const vector<std::string_view> &expected, vector<string> &replies, unsigned depth, unsigned max_length = 4096)
+   {
+      assert(expected.size() == messages.size());
+      replies.resize(messages.size());
+      for(string &r: replies) r.clear();
+      if(fPool.size()){
+         PoolExchange(messages, expected, replies, depth, max_length);
+         return;
+      }
+      unsigned sent = 0, done = 0;
+      bool ok = true;
+      while(done < messages.size()){
+         while(ok && sent < messages.size() && (depth == 0 || fPending.size() < depth) && !DeadlineExpired()){
+            ok = Post(messages[sent], true, expected[sent]);
+            if(ok) sent++;
+         }
+         if(fPending.empty()) break;
+         if(!Collect(replies[done++], max_length))
+            done = sent; // Collect() dropped all outstanding requests, their replies stay empty
+      }
+   }
+
+   /** \brief Open additional connections to the same server.
+    *
+    * While the pool is open, the pipelined Exchange() spreads its requests over all
+    * connections, so a server handling clients in parallel answers them concurrently.
+    *
+    * Not possible for \c shm: endpoints, their segment only takes one client.
+    *
+    * \param n total number of connections, including the main one
+    * \param greeting handshake sent on each new connection
+    * \param expected required beginning of the handshake reply
+    * \return number of connections actually open
+    */
+   unsigned OpenPool(unsigned n, const string &greeting, const string &expected)
+   {
+      ClosePool();
+      fPoolGreeting = greeting;
+      fPoolExpected = expected;
+      if(!tcp || !tcp->fConnected) return 0;
+      if(n > 1 && fHostname.compare(0, 4, "shm:") == 0){
+         // a shared memory segment carries exactly one client, a second one would reset its rings
+         cerr << "OpenPool: shared memory endpoint " << fHostname << " takes a single connection" << endl;
+         return 1;
+      }
+      while(n > 1 + fPool.size()){
+         KOtcpConnection *c = OpenPoolConnection();
+         if(!c) break;
+         fPool.push_back(c);
+      }
+      return 1 + fPool.size();
+   }
+
+   /** \brief Open one more connection with the settings of the main one and send the pool handshake, NULL on failure. */
+   KOtcpConnection *OpenPoolConnection()
+   {
+      KOtcpConnection *c = new KOtcpConnection(fHostname.c_str(),fPortnum.c_str());
+      c->fConnectTimeoutMilliSec = tcp->fConnectTimeoutMilliSec;
+      c->fReadTimeoutMilliSec = tcp->fMaxReadTimeoutMilliSec > 0 ? tcp->fMaxReadTimeoutMilliSec : tcp->fReadTimeoutMilliSec;
+      c->fMinReadTimeoutMilliSec = tcp->fMinReadTimeoutMilliSec;
+      c->fMaxReadTimeoutMilliSec = tcp->fMaxReadTimeoutMilliSec;
+      c->fWriteTimeoutMilliSec = tcp->fWriteTimeoutMilliSec;
+      c->fKeepAliveSec = tcp->fKeepAliveSec;
+      c->fUserTimeoutMilliSec = tcp->fUserTimeoutMilliSec;
+      c->fUseUring = tcp->fUseUring;
+      string resp;
+      KOtcpError err = c->Connect();
+      if(!err.error) err = c->WriteString(fPoolGreeting);
+      if(!err.error) err = c->ReadString(&resp,4096);
+      if(err.error || resp.find(fPoolExpected) != 0){
+         cerr << "OpenPoolConnection: failed: " << (err.error ? err.message : "unexpected reply " + resp) << endl;
+         delete c;
+         return NULL;
+      }
+      c->fDeadline = tcp->fDeadline;
+      return c;
+   }
+
+   /** \brief Number of connections to the server, including the main one. */
+   unsigned Connections() const { return 1 + fPool.size(); }
+
+   /** \brief Close the additional connections opened by OpenPool(). */
+   void ClosePool()
+   {
+      for(KOtcpConnection *c: fPool)
+         delete c;
+      fPool.clear();
+   }
+
+   /** \brief Bound all following exchanges on all connections.
+    *
+    * \param deadline KOtcpConnection::Now() time after which reads and writes time out, 0 for no bound
+    */
+   void SetDeadline(double deadline)
+   {
+      if(tcp) tcp->fDeadline = deadline;
+      for(KOtcpConnection *c: fPool)
+         c->fDeadline = deadline;
+   }
+
+   /** \brief \c true once the deadline set with SetDeadline() has passed. */
+   bool DeadlineExpired() const { return tcp && tcp->DeadlineExpired(); }
+
+   /** \brief Pipelined exchange over the main connection and the pool.
+    *
+    * Each connection gets a contiguous share of \p messages, keeps up to \p depth of them
+    * on the wire and replies are collected round-robin, one per connection at a time.
+    * Replies are returned in the order of \p messages, failed requests give an empty reply.
+    */
+   void PoolExchange(const vector<std::string_view> &messages, const vector<std::string_view> &expected, vector<string> &replies, unsigned depth, unsigned max_length)
+   {
+      if(fPending.size()){
+         cerr << "PoolExchange: discarding " << fPending.size() << " outstanding replies" << endl;
+         while(fPending.size()) Collect();
+      }
+      vector<KOtcpConnection*> conns(1, tcp);
+      conns.insert(conns.end(), fPool.begin(), fPool.end());
+      unsigned n = conns.size();
+      vector<double> posted(messages.size()), last(n);
+      vector<unsigned> sent(n), done(n), end(n);
+      vector<bool> failed(n);
+      for(unsigned k = 0; k < n; k++){
+         sent[k] = done[k] = k*messages.size()/n;
+         end[k] = (k+1)*messages.size()/n;
+      }
+      bool busy = true;
+      while(busy){
+         for(unsigned k = 0; k < n; k++){
+            if(conns[k]->DeadlineExpired()) end[k] = sent[k];
+            while(sent[k] < end[k] && (depth == 0 || sent[k] - done[k] < depth)){
+               KOtcpError err = conns[k]->QueueBytes(messages[sent[k]].data(), messages[sent[k]].size());
                if(err.error){
                   cerr << err.message << endl;
-                  return resp;
-               }
-               if(expected.size()){
-                  if(resp.find(expected) != 0){
-                     cerr << "Did not receive expected string \"" << expected << "\" at beginning of response, response was " << resp << endl;
-                     return "";
-                  }
+                  end[k] = sent[k];
+                  failed[k] = true;
+                  break;
                }
+               posted[sent[k]] = KOtcpConnection::Now();
+               sent[k]++;
             }
+            if(conns[k]->fConnected) conns[k]->Flush(false);
          }
+         busy = false;
+         for(unsigned k = 0; k < n; k++){
+            if(done[k] == sent[k]) continue;
+            string &resp = replies[done[k]];
+            KOtcpError err = ReadReply(conns[k], resp, expected[done[k]], max_length);
+            if(err.error){
+               // give up on this connection for now, late replies are discarded by the next read
+               cerr << err.message << endl;
+               resp.clear();
+               end[k] = done[k] = sent[k];
+               failed[k] = true;
+               continue;
+            }
+            double now = KOtcpConnection::Now();
+            conns[k]->AddRttSample(now - std::max(posted[done[k]], last[k]));
+            last[k] = now;
+            if(k == 0) fLastReply = fLastReceived = now;
+            done[k]++;
+         }
+         for(unsigned k = 0; k < n; k++)
+            busy |= (done[k] < end[k]);
       }
+      // a failed pool connection would fail its share again every time, replace it by a
+      // fresh one or drop it. The main connection is left to the caller.
+      for(unsigned k = n - 1; k > 0; k--){
+         if(!failed[k]) continue;
+         delete fPool[k-1];
+         KOtcpConnection *c = tcp->fConnected ? OpenPoolConnection() : NULL;
+         if(c){
+            fPool[k-1] = c;
+         } else {
+            cerr << "PoolExchange: dropping connection " << k << endl;
+            fPool.erase(fPool.begin() + k - 1);
+         }
+      }
+   }
+
+   /** \brief Send length-prefixed binary frame.
+    *
+    * The frame is a 32 bit big-endian payload length followed by the payload.
+    */
+   bool WriteFrame(const string &payload)
+   {
+      if(!tcp || !tcp->fConnected) return false;
+      uint32_t len = htonl(payload.size());
+      string frame((const char*)&len, sizeof(len));
+      frame += payload;
+      KOtcpError err = tcp->WriteString(frame);
+      if(err.error){
+         cerr << err.message << endl;
+         return false;
+      }
+      return true;
+   }
+
+   /** \brief Receive length-prefixed binary frame.
+    *
+    * \param payload frame content without length prefix
+    * \param max_length maximum accepted payload length
+    */
+   bool ReadFrame(string &payload, unsigned max_length = 1<<20)
+   {
+      if(!tcp || !tcp->fConnected) return false;
+      uint32_t len = 0;
+      KOtcpError err = tcp->ReadBytes((char*)&len, sizeof(len));
+      if(!err.error){
+         len = ntohl(len);
+         if(len > max_length){
+            cerr << "ReadFrame: frame length " << len << " exceeds maximum " << max_length << endl;
+            return false;
+         }
+         payload.resize(len);
+         if(len) err = tcp->ReadBytes(&payload[0], len);
+      }
+      if(err.error){
+         cerr << err.message << endl;
+         return false;
+      }
+      return true;
+   }
+
+   /** \brief Put request on the wire without waiting for the reply.
+    *
+    * Replies to posted requests have to be picked up in order with Collect().
+    *
+    * \param message text to be sent to server
+    * \param expect_reply server will send a response to this request
+    * \param expected required beginning of the response, not copied: has to stay valid until the reply is collected
+    */
+   bool Post(std::string_view message, bool expect_reply = true, std::string_view expected = "")
+   {
+      if(!tcp || !tcp->fConnected) return false;
+      // requests expecting a reply go out together with the next read
+      KOtcpError err = expect_reply ? tcp->QueueBytes(message.data(), message.size()) : tcp->WriteBytes(message.data(), message.size());
+      if(err.error){
+         cerr << err.message << endl;
+         return false;
+      }
+      if(expect_reply) fPending.emplace_back(expected, KOtcpConnection::Now());
+      return true;
+   }
+
+   /** \brief Read the next line from \p c starting with \p expected.
+    *
+    * Other lines are late replies to requests given up after a timeout, or requests the
+    * server never answered at all, and are discarded. On the main connection they are kept
+    * for ReadPushed() instead if the server may push lines. A partial line stays buffered
+    * when the read times out, so the next read does not start in the middle of a reply.
+    */
+   KOtcpError ReadReply(KOtcpConnection *c, string &resp, std::string_view expected, unsigned max_length)
+   {
+      while(1){
+         std::string_view line;
+         KOtcpError err = c->ReadStringView(&line,max_length);
+         resp.assign(line.data(), line.size());
+         if(err.error) return err;
+         if(!resp.size()) continue; // empty line, e.g. CR and LF arrived in separate packets
+         if(resp.compare(0, expected.size(), expected) == 0) return err;
+         if(c == tcp && fAcceptPushed){
+            fPushed.push_back(resp);
+         } else {
+            cerr << "Did not receive expected string \"" << expected << "\" at beginning of response, discarding " << resp << endl;
+         }
+      }
+   }
+
+   /** \brief Receive reply to the oldest outstanding request.
+    *
+    * On a read error all outstanding requests are dropped. Their replies may still
+    * arrive later, ReadReply() discards them as they do not start with the expected text.
+    *
+    * \param resp response, empty on failure. Its capacity is reused
+    * \param max_length maximum length of the response, 0 for no limit
+    */
+   bool Collect(string &resp, unsigned max_length = 4096)
+   {
+      resp.clear();
+      if(fPending.empty()){
+         cerr << "Collect: no outstanding request" << endl;
+         return false;
+      }
+      std::string_view expected = fPending.front().first;
+      double posted = fPending.front().second;
+      fPending.pop_front();
+      KOtcpError err = ReadReply(tcp, resp, expected, max_length);
+      if(err.error){
+         cerr << err.message << endl;
+         fPending.clear();
+         resp.clear();
+         return false;
+      }
+      // with pipelining the wait for this reply starts when the previous one arrived
+      double now = KOtcpConnection::Now();
+      tcp->AddRttSample(now - std::max(posted, fLastReply));
+      fLastReply = fLastReceived = now;
+      return true;
+   }
+
+   /** \brief Collect() returning the response. */
+   string Collect(unsigned max_length = 4096)
+   {
+      string resp;
+      Collect(resp, max_length);
       return resp;
    }
+
+   /** \brief Get next line the server sent without being asked.
+    *
+    * Only valid while no requests are outstanding, never blocks. A partial line stays
+    * buffered until the rest of it has arrived.
+    *
+    * \param line unsolicited line from the server
+    */
+   bool ReadPushed(string &line)
+   {
+      line.clear();
+      if(fPushed.size()){
+         line = fPushed.front();
+         fPushed.pop_front();
+         return true;
+      }
+      if(!tcp || !tcp->fConnected || fPending.size()) return false;
+      bool polled = false;
+      while(1){
+         if(tcp->GetBufferedString(&line)){
+            if(!line.size()) continue; // empty line, e.g. CR and LF arrived in separate packets
+            fLastReceived = KOtcpConnection::Now();
+            return true;
+         }
+         if(polled) return false;
+         int nbytes = 0;
+         bool closed = false;
+         KOtcpError err = tcp->ReadAvailable(&nbytes, &closed);
+         if(closed){
+            // server went away, TCPConnected() reports it so the caller can reconnect
+            cerr << "Connection closed by " << fHostname << endl;
+            tcp->Close();
+            return false;
+         }
+         if(err.error || nbytes == 0) return false;
+         polled = true;
+      }
+   }
 };
 
 #endif